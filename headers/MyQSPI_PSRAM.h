@@ -11,8 +11,11 @@
 #include "hardware/pio.h"
 #include "hardware/dma.h"
 #include "hardware/sync.h"
+#include "hardware/irq.h"
 #include "hardware/structs/bus_ctrl.h"
 
+#include "MyQSPI_PSRAM_Trace.h"
+
 // ---------- PIOS ----------
 
 #include "qspi_rw_2_nf.pio.h"
@@ -29,13 +32,86 @@
     #define PSRAM_MIN_CLOCK 100000000
 #endif
 
+#ifndef PSRAM_PAGE_SIZE
+    #define PSRAM_PAGE_SIZE 1024u
+#endif
+
 enum class MyQSPI_ERRORS : int8_t {
     PSRAM_OK = 0,
     PSRAM_ERROR_COULD_NOT_FIND_SUITABLE_CLOCK_DIV = 1,
     PSRAM_ERROR_COULD_NOT_DETECT_PSRAM = 2,
-    PIO_ERROR_COULD_NOT_INITIALIZE = 3
+    PIO_ERROR_COULD_NOT_INITIALIZE = 3,
+    PSRAM_ERROR_SELF_TEST_FAILED = 4
+};
+
+enum MyQSPI_TESTS : uint8_t {
+    MYQSPI_TEST_WALKING_ONES = 1,   // Data lines and address lines.
+    MYQSPI_TEST_ADDRESS = 2,        // Every word holds its own address.
+    MYQSPI_TEST_BURSTS = 4,         // Every burst length, inside a page.
+    MYQSPI_TEST_MARCH_C = 8,        // March C- over the whole psram, page sized blocks.
+    MYQSPI_TEST_QUICK = MYQSPI_TEST_WALKING_ONES | MYQSPI_TEST_ADDRESS | MYQSPI_TEST_BURSTS,
+    MYQSPI_TEST_ALL = MYQSPI_TEST_QUICK | MYQSPI_TEST_MARCH_C
+};
+
+/// @brief Operation of the read-modify-write calls.
+enum class MyQSPI_RMW_OP : uint8_t {
+    ADD = 0,
+    OR = 1,
+    AND = 2,
+    XOR = 3
+};
+
+#ifndef MYQSPI_PSRAM_TEST_MAX_FAILS
+    #define MYQSPI_PSRAM_TEST_MAX_FAILS 16
+#endif
+
+/// @brief One failing byte found by self_test().
+struct MyQSPI_TestFail{
+    uint32_t addr;
+    uint8_t expected;
+    uint8_t actual;
+    uint8_t test;       // MyQSPI_TESTS bit of the test that found it.
+    uint8_t burst_len;  // Burst length for MYQSPI_TEST_BURSTS, 0 otherwise.
+};
+
+/// @brief Result of self_test().
+struct MyQSPI_TestReport{
+    uint32_t errors;                // Failing bytes, including the ones not stored in fails.
+    uint32_t fail_count;            // Valid entries in fails.
+    MyQSPI_TestFail fails[MYQSPI_PSRAM_TEST_MAX_FAILS];
+    uint32_t burst_fail_mask;       // Bit n set: burst length MyQSPI_PSRAM::test_burst_lengths[n] failed.
+    uint32_t time_us;
 };
 
+#ifndef MYQSPI_PSRAM_COMBINE_SIZE
+    #define MYQSPI_PSRAM_COMBINE_SIZE 124u
+#endif
+
+#ifndef MYQSPI_PSRAM_FILL_CHUNK
+    #define MYQSPI_PSRAM_FILL_CHUNK 64u
+#endif
+
+#ifndef MYQSPI_PSRAM_FILL_BATCH
+    #define MYQSPI_PSRAM_FILL_BATCH 16u
+#endif
+
+static_assert(MYQSPI_PSRAM_FILL_CHUNK >= 4u && MYQSPI_PSRAM_FILL_CHUNK <= 124u, "MYQSPI_PSRAM_FILL_CHUNK must be 4..124, the pio counts 8 bit nibbles");
+static_assert(PSRAM_PAGE_SIZE % MYQSPI_PSRAM_FILL_CHUNK == 0, "MYQSPI_PSRAM_FILL_CHUNK must divide PSRAM_PAGE_SIZE, chunks must not cross a page");
+static_assert(MYQSPI_PSRAM_FILL_CHUNK % 4u == 0, "MYQSPI_PSRAM_FILL_CHUNK must be a multiple of 4 to keep 16 and 32 bit patterns in phase");
+static_assert(MYQSPI_PSRAM_FILL_BATCH >= 1u, "MYQSPI_PSRAM_FILL_BATCH must be at least 1");
+
+#ifndef MYQSPI_PSRAM_FILL_IRQ
+    #define MYQSPI_PSRAM_FILL_IRQ 1
+#endif
+
+#ifndef MYQSPI_PSRAM_QOS_LATENCY_US
+    #define MYQSPI_PSRAM_QOS_LATENCY_US 20u
+#endif
+
+#if defined(MYQSPI_PSRAM_USE_QOS) && !defined(MYQSPI_PSRAM_USE_SPINLOCK)
+    #error "MYQSPI_PSRAM_USE_QOS needs MYQSPI_PSRAM_USE_SPINLOCK"
+#endif
+
 #ifdef MYQSPI_PSRAM_RUN_FROM_SRAM
     #define MYQSPI_PSRAM_FUNC_WRAPPER(x) __no_inline_not_in_flash_func(x)
 #else
@@ -51,9 +127,21 @@ class MyQSPI_PSRAM{
         /// @param pio_num choose pio(optional, default is 0)
         MyQSPI_PSRAM(uint8_t cs_sck_pins, uint8_t data_pins, uint8_t pio_num=0);
 
-        /// @brief Initialize the psram.
+        /// @brief Initialize the psram. The first call detects the chip, later calls reuse the cached size.
         MyQSPI_ERRORS initPSRAM();
 
+        /// @brief Restore the pins, the state machine and the DMA channels after a sleep, the psram must have stayed powered.
+        /// No psram commands and no waits, the chip is expected to still be in quad mode.
+        MyQSPI_ERRORS resume();
+
+        /// @brief Like resume(), but also resets the psram and puts it back into quad mode, for when it lost power or its mode is unknown.
+        /// The psram must have been powered for at least 150us. Writes still held by write combining are dropped.
+        MyQSPI_ERRORS reinit();
+
+        /// @brief Release the pio program and state machine, the DMA channels and the spinlock. The detected size is kept,
+        /// so a later initPSRAM() skips the detection. The pins stay assigned to the pio.
+        void deinit();
+
         /// @brief Write 1 byte of data to the psram.
         /// @param addr Write address. 
         /// @param data Data.
@@ -79,10 +167,10 @@ class MyQSPI_PSRAM{
         /// @param data Pointer to the data. Make sure it's at least 64 bytes of length. 
         void MYQSPI_PSRAM_FUNC_WRAPPER(write512)(uint32_t addr, const uint8_t* data);
 
-        /// @brief Write a block of data .
+        /// @brief Write a block of data, split into bursts at page boundaries.
         /// @param addr Write address.
         /// @param data Pointer to the data buffer.
-        /// @param data_len Length of the data buffer. MAX is 2048
+        /// @param data_len Length of the data buffer.
         void MYQSPI_PSRAM_FUNC_WRAPPER(write)(uint32_t addr, const uint8_t* data, uint32_t data_len);
 
         /// @brief Read 1 byte of data from the psram.
@@ -110,10 +198,10 @@ class MyQSPI_PSRAM{
         /// @param data Pointer to the read buffer. Make sure it's at least 64 bytes of length
         void MYQSPI_PSRAM_FUNC_WRAPPER(read512)(uint32_t addr, uint8_t* data);
 
-        /// @brief Read a block of data .
+        /// @brief Read a block of data, split into bursts at page boundaries.
         /// @param addr Read address.
         /// @param data Pointer to the read buffer.
-        /// @param data_len Length of the data to be read. MAX is 2048
+        /// @param data_len Length of the data to be read.
         void MYQSPI_PSRAM_FUNC_WRAPPER(read)(uint32_t addr, uint8_t* data, const uint32_t data_len);
 
         /// @brief Write a value across a block of memory.
@@ -122,12 +210,132 @@ class MyQSPI_PSRAM{
         /// @param size Size of the block to write.
         void MYQSPI_PSRAM_FUNC_WRAPPER(pmemset)(uint32_t addr, uint8_t val, const uint32_t size);
 
+        /// @brief Write a 16 bit pattern across a block of memory.
+        /// @param addr Address of the first byte.
+        /// @param val Pattern to write, low byte goes to addr.
+        /// @param size Size of the block to write in bytes.
+        void MYQSPI_PSRAM_FUNC_WRAPPER(pmemset16)(uint32_t addr, uint16_t val, const uint32_t size);
+
+        /// @brief Write a 32 bit pattern across a block of memory.
+        /// @param addr Address of the first byte.
+        /// @param val Pattern to write, low byte goes to addr.
+        /// @param size Size of the block to write in bytes.
+        void MYQSPI_PSRAM_FUNC_WRAPPER(pmemset32)(uint32_t addr, uint32_t val, const uint32_t size);
+
+        /// @brief Start filling a block of memory in the background. Other calls wait until it's done.
+        /// @param addr Address of the first byte.
+        /// @param val Pattern to write, low byte goes to addr.
+        /// @param val_size Size of the pattern in bytes, 1, 2 or 4.
+        /// @param size Size of the block to write in bytes.
+        /// @return false if val_size is not 1, 2 or 4, nothing is written then.
+        bool MYQSPI_PSRAM_FUNC_WRAPPER(pmemset_async)(uint32_t addr, uint32_t val, uint8_t val_size, const uint32_t size);
+
+        /// @brief Check if a fill started with pmemset_async() is still running.
+        bool pmemset_busy(){ return fill_active || fill_parked; };
+
+        /// @brief Wait for a fill started with pmemset_async() to finish.
+        void MYQSPI_PSRAM_FUNC_WRAPPER(pmemset_wait)();
+
         /// @brief Copy a block of memory from one place to another.
         /// @param addr_dst Destination address.
         /// @param addr_src Source address.
         /// @param size Size of the block to copy.
         void MYQSPI_PSRAM_FUNC_WRAPPER(pmemcpy)(uint32_t addr_dst, uint32_t addr_src, const uint32_t size);
 
+        /// @brief Add to a word with one locked read and write.
+        /// @param addr Address of the word, must not cross a page.
+        /// @param val Value to add.
+        /// @return Value before the add.
+        uint32_t fetch_add(uint32_t addr, uint32_t val){ return fetch_op(MyQSPI_RMW_OP::ADD, addr, val); };
+
+        /// @brief Or bits into a word with one locked read and write.
+        /// @return Value before the or.
+        uint32_t fetch_or(uint32_t addr, uint32_t val){ return fetch_op(MyQSPI_RMW_OP::OR, addr, val); };
+
+        /// @brief And a mask into a word with one locked read and write.
+        /// @return Value before the and.
+        uint32_t fetch_and(uint32_t addr, uint32_t val){ return fetch_op(MyQSPI_RMW_OP::AND, addr, val); };
+
+        /// @brief Xor bits into a word with one locked read and write.
+        /// @return Value before the xor.
+        uint32_t fetch_xor(uint32_t addr, uint32_t val){ return fetch_op(MyQSPI_RMW_OP::XOR, addr, val); };
+
+        /// @brief Set a bit of a word, the write is skipped if it was already set.
+        /// @param addr Address of the word.
+        /// @param bit Bit number, 0 to 31.
+        /// @return true if the bit was set before.
+        bool test_and_set_bit(uint32_t addr, uint8_t bit){ return fetch_op(MyQSPI_RMW_OP::OR, addr, 1u << bit) & (1u << bit); };
+
+        /// @brief Clear a bit of a word, the write is skipped if it was already clear.
+        /// @param addr Address of the word.
+        /// @param bit Bit number, 0 to 31.
+        /// @return true if the bit was set before.
+        bool test_and_clear_bit(uint32_t addr, uint8_t bit){ return fetch_op(MyQSPI_RMW_OP::AND, addr, ~(1u << bit)) & (1u << bit); };
+
+        /// @brief Replace a word if it holds the expected value, with one locked read and write.
+        /// @param addr Address of the word, must not cross a page.
+        /// @param expected Expected value, set to the current value if they differ.
+        /// @param desired Value to write.
+        /// @return true if the word was replaced.
+        bool MYQSPI_PSRAM_FUNC_WRAPPER(compare_exchange)(uint32_t addr, uint32_t& expected, uint32_t desired);
+
+        /// @brief Apply an operation to consecutive words, e.g. histogram bins or bitmap words.
+        /// Every 124 bytes take one burst read and one burst write, and each page is updated atomically.
+        /// Without MYQSPI_PSRAM_USE_SPINLOCK interrupts stay off for the whole call.
+        /// @param op Operation.
+        /// @param addr Address of the first word, 4 byte aligned.
+        /// @param vals One operand per word.
+        /// @param count Number of words.
+        /// @param old_vals Receives the values before the update (optional).
+        void MYQSPI_PSRAM_FUNC_WRAPPER(update_words)(MyQSPI_RMW_OP op, uint32_t addr, const uint32_t* vals, uint32_t count, uint32_t* old_vals=nullptr);
+
+        /// @brief Issue the writes collected by write combining. Does nothing without MYQSPI_PSRAM_USE_WRITE_COMBINING.
+        void MYQSPI_PSRAM_FUNC_WRAPPER(flush)();
+
+#ifdef MYQSPI_PSRAM_USE_TRACE
+        /// @brief Start recording calls into a ring, the oldest records are overwritten once it's full.
+        /// @param ring Record storage, must stay valid until trace_dump() returned.
+        /// @param ring_len Number of records in ring.
+        void trace_start(MyQSPI_TraceRecord* ring, uint32_t ring_len);
+
+        /// @brief Stop recording, the recorded calls stay available for trace_dump().
+        void trace_stop();
+
+        /// @brief Stop recording and write a MyQSPI_TraceHeader followed by the records, oldest first.
+        /// @param out Called with consecutive pieces of the dump, e.g. a wrapper around fwrite to stdout.
+        void trace_dump(void (*out)(const uint8_t* data, uint32_t len));
+#endif // MYQSPI_PSRAM_USE_TRACE
+
+#ifdef MYQSPI_PSRAM_USE_QOS
+        /// @brief Set how long a small access may wait behind write(), read(), pmemset() or pmemcpy().
+        /// Those are split into quanta that take about that long on the bus, a page at most.
+        /// update_words() only hands over between pages.
+        /// @param latency_us Wait bound in microseconds, on top of the small access itself.
+        /// @return Quantum in bytes.
+        uint32_t set_qos_latency(uint32_t latency_us);
+
+        /// @brief Get the number of bytes a bulk transfer moves before it lets waiting accesses in.
+        uint32_t get_qos_quantum(){ return qos_quantum; };
+
+        /// @brief Get how many times a bulk transfer stepped aside for a small access.
+        uint32_t get_qos_preemptions(){ return qos_preemptions; };
+
+        /// @brief Get the longest time a small access waited for the bus, in microseconds.
+        uint32_t get_qos_max_wait_us(){ return qos_max_wait_us; };
+
+        /// @brief Clear the preemption count and the longest wait.
+        void reset_qos_stats(){ qos_preemptions = 0; qos_max_wait_us = 0; };
+#endif // MYQSPI_PSRAM_USE_QOS
+
+        /// @brief Test the data path of the whole psram. Destroys the psram contents and uses the DMA sniffer.
+        /// @param report Filled with the failing addresses and burst lengths.
+        /// @param block Scratch buffer of PSRAM_PAGE_SIZE bytes, 4 byte aligned. Pass a static buffer, it's too big for the stack.
+        /// @param tests MyQSPI_TESTS bits of the tests to run.
+        MyQSPI_ERRORS self_test(MyQSPI_TestReport& report, uint8_t* block, uint8_t tests=MYQSPI_TEST_QUICK);
+
+        /// @brief Burst lengths checked by MYQSPI_TEST_BURSTS, in the order of the report masks.
+        static constexpr uint8_t test_burst_lengths[] = {1, 2, 4, 8, 16, 32, 64, 124};
+
         /// @brief Get the size of the psram.
         /// @return Size of the psram bytes.
         uint32_t get_size(){ return psram_size;};
@@ -136,24 +344,236 @@ class MyQSPI_PSRAM{
         uint8_t cs_sck_pins, data_pins;
 
         PIO _pio;
-        uint32_t dma_chan_read, dma_chan_write;
+        uint32_t dma_chan_read, dma_chan_write, dma_chan_header, dma_chan_control;
         dma_channel_config dma_write_config, dma_read_config;
 
-        uint qspi_sm;
+        uint qspi_sm, qspi_offset;
+        pio_sm_config qspi_sm_config;
         pio_program qspi_program;
         uint8_t qspi_wrap_target;
         uint8_t qspi_wrap;
         uint8_t clock_divider;
 
         alignas(4) uint8_t buffer[132];
+        alignas(4) uint8_t header_buffer[16];
+        bool chain_pending;
+
+        alignas(8) uint8_t fill_headers[MYQSPI_PSRAM_FILL_BATCH][8];
+        alignas(8) uint32_t fill_blocks[MYQSPI_PSRAM_FILL_BATCH+1][2];
+        alignas(4) uint32_t fill_value;
+        uint32_t fill_base, fill_addr, fill_remaining;
+        uint8_t fill_val_size;
+        volatile bool fill_active, fill_parked;
+
+        static inline MyQSPI_PSRAM* fill_owner[NUM_DMA_CHANNELS] = {};
+        static inline bool fill_irq_installed = false;
+
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+        alignas(4) uint8_t combine_buffer[8+MYQSPI_PSRAM_COMBINE_SIZE];
+        uint32_t combine_addr, combine_len;
+#endif // MYQSPI_PSRAM_USE_WRITE_COMBINING
+
+#ifdef MYQSPI_PSRAM_USE_TRACE
+        MyQSPI_TraceRecord* trace_ring;
+        uint32_t trace_size, trace_head, trace_count;
+        bool trace_enabled;
+#endif // MYQSPI_PSRAM_USE_TRACE
 
 #ifdef MYQSPI_PSRAM_USE_SPINLOCK
         spin_lock_t *psram_spinlock;
 #endif // MYQSPI_PSRAM_USE_SPINLOCK
+
+#ifdef MYQSPI_PSRAM_USE_QOS
+        uint32_t qos_quantum, qos_bytes;
+        uint32_t qos_preemptions, qos_max_wait_us, qos_served;
+        volatile uint8_t qos_waiting[NUM_CORES];
+#endif // MYQSPI_PSRAM_USE_QOS
         uint32_t psram_size;
+        bool initialized, detected;
         
     private: // private Functions
         uint8_t find_clock_divisor();
+
+        void setup_pins();
+        void exit_quad_mode();
+        MyQSPI_ERRORS detect();
+        int start_qspi_sm();
+        void setup_dma();
+        void reset_to_quad_mode();
+        void send_quad_command(uint8_t cmd);
+        void send_spi_command(uint8_t cmd);
+
+        void test_walking_ones(MyQSPI_TestReport& report);
+        void test_address(MyQSPI_TestReport& report, uint8_t* block);
+        void test_bursts(MyQSPI_TestReport& report, uint8_t* block);
+        void test_march(MyQSPI_TestReport& report, uint8_t* block);
+        bool test_block(MyQSPI_TestReport& report, uint32_t addr, uint8_t* block, uint8_t expected, uint8_t test);
+        void test_fail(MyQSPI_TestReport& report, uint32_t addr, uint8_t expected, uint8_t actual, uint8_t test, uint8_t burst_len);
+
+        uint32_t MYQSPI_PSRAM_FUNC_WRAPPER(fetch_op)(MyQSPI_RMW_OP op, uint32_t addr, uint32_t val);
+        void MYQSPI_PSRAM_FUNC_WRAPPER(stage_read)(uint32_t addr, uint32_t len);
+        void MYQSPI_PSRAM_FUNC_WRAPPER(stage_write)(uint32_t addr, uint32_t len);
+
+        __force_inline static uint32_t rmw_apply(MyQSPI_RMW_OP op, uint32_t old_val, uint32_t val){
+            switch(op){
+                case MyQSPI_RMW_OP::ADD: return old_val + val;
+                case MyQSPI_RMW_OP::OR: return old_val | val;
+                case MyQSPI_RMW_OP::AND: return old_val & val;
+                case MyQSPI_RMW_OP::XOR: return old_val ^ val;
+            }
+            return old_val;
+        };
+
+        void MYQSPI_PSRAM_FUNC_WRAPPER(start_chain)(const uint8_t* header, const uint8_t* payload, uint32_t payload_len);
+        void MYQSPI_PSRAM_FUNC_WRAPPER(wait_for_chain)();
+
+        void MYQSPI_PSRAM_FUNC_WRAPPER(fill)(uint32_t& intr_state, uint32_t addr, uint32_t val, uint8_t val_size, uint32_t size);
+        void MYQSPI_PSRAM_FUNC_WRAPPER(fill_start)(uint32_t addr, uint32_t val, uint8_t val_size, uint32_t size, uint8_t phase=0);
+        void MYQSPI_PSRAM_FUNC_WRAPPER(fill_next_batch)();
+        uint32_t MYQSPI_PSRAM_FUNC_WRAPPER(fill_batch_chunks)(uint32_t addr, uint32_t remaining, uint32_t& chunk_len);
+        void MYQSPI_PSRAM_FUNC_WRAPPER(fill_park)();
+        void MYQSPI_PSRAM_FUNC_WRAPPER(fill_resume)();
+        static void MYQSPI_PSRAM_FUNC_WRAPPER(fill_irq_handler)();
+
+        // Offset into the pattern of the next byte to fill.
+        __force_inline uint8_t fill_phase(){
+            return (fill_addr - fill_base) % fill_val_size;
+        };
+
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+        bool MYQSPI_PSRAM_FUNC_WRAPPER(combine_write)(uint32_t addr, const uint8_t* data, uint32_t data_len);
+        bool MYQSPI_PSRAM_FUNC_WRAPPER(combine_read)(uint32_t addr, uint8_t* data, uint32_t data_len);
+        void MYQSPI_PSRAM_FUNC_WRAPPER(combine_flush)();
+        void MYQSPI_PSRAM_FUNC_WRAPPER(combine_flush_overlap)(uint32_t addr, uint32_t data_len);
+
+        __force_inline bool combine_overlaps(uint32_t addr, uint32_t data_len){
+            return combine_len && addr < combine_addr + combine_len && addr + data_len > combine_addr;
+        };
+#endif // MYQSPI_PSRAM_USE_WRITE_COMBINING
+
+        // Also waits out a background fill, so every entry point sees an idle bus.
+        __force_inline uint32_t lock(){
+#ifdef MYQSPI_PSRAM_USE_SPINLOCK
+            for(;;){
+                uint32_t intr_state = spin_lock_blocking(psram_spinlock);
+#ifdef MYQSPI_PSRAM_USE_QOS
+                // A parked fill was started first, so it's restarted and waited out.
+                if(fill_parked) fill_resume();
+#endif
+                if(!fill_active) return intr_state;
+                spin_unlock(psram_spinlock, intr_state);
+                tight_loop_contents();
+            }
+#else
+            while(fill_active) tight_loop_contents();
+            return 0;
+#endif
+        };
+
+#ifdef MYQSPI_PSRAM_USE_QOS
+        uint32_t MYQSPI_PSRAM_FUNC_WRAPPER(qos_handover)(uint32_t intr_state);
+
+        // Counts a piece before it's sent, true if it would take the transfer past the quantum.
+        // The lock is handed over first then, and the piece starts the next quantum.
+        __force_inline bool qos_due(uint32_t bytes){
+            qos_bytes += bytes;
+            if(qos_bytes <= qos_quantum) return false;
+            qos_bytes = bytes;
+            return true;
+        };
+
+        __force_inline bool qos_contended(){
+            for(uint32_t i = 0; i < NUM_CORES; ++i){
+                if(qos_waiting[i]) return true;
+            }
+            return false;
+        };
+#endif // MYQSPI_PSRAM_USE_QOS
+
+        // Small accesses announce themselves, so bulk transfers hand over the lock at the next quantum
+        // and background fills park at the next batch.
+        __force_inline uint32_t lock_priority(uint32_t addr, uint32_t len){
+#ifdef MYQSPI_PSRAM_USE_QOS
+            uint32_t core = get_core_num();
+            qos_waiting[core] = qos_waiting[core] + 1u;
+            uint32_t start = time_us_32();
+            uint32_t intr_state;
+            for(;;){
+                intr_state = spin_lock_blocking(psram_spinlock);
+                // A parked fill only goes first if the access touches the part it hasn't written yet.
+                if(fill_parked && addr < fill_addr + fill_remaining && addr + len > fill_addr) fill_resume();
+                if(!fill_active) break;
+                spin_unlock(psram_spinlock, intr_state);
+                tight_loop_contents();
+            }
+            qos_waiting[core] = qos_waiting[core] - 1u;
+
+            uint32_t wait = time_us_32() - start;
+            if(wait > qos_max_wait_us) qos_max_wait_us = wait;
+            ++qos_served;
+            return intr_state;
+#else
+            (void)addr;
+            (void)len;
+            return lock();
+#endif
+        };
+
+        // Called by bulk transfers before each piece, with nothing else in flight.
+        __force_inline uint32_t qos_yield(uint32_t intr_state, uint32_t bytes){
+#ifdef MYQSPI_PSRAM_USE_QOS
+            if(qos_due(bytes)) return qos_handover(intr_state);
+#else
+            (void)bytes;
+#endif
+            return intr_state;
+        };
+
+        __force_inline void trace(MyQSPI_TRACE_OP op, uint32_t addr, uint32_t len){
+#ifdef MYQSPI_PSRAM_USE_TRACE
+            if(!trace_enabled) return;
+            trace_ring[trace_head] = {time_us_32(), myqspi_trace_pack(op, addr), len};
+            if(++trace_head == trace_size) trace_head = 0;
+            ++trace_count;
+#else
+            (void)op; (void)addr; (void)len;
+#endif
+        };
+
+        // Read-modify-write ops keep interrupts off between their read and write. The spinlock does
+        // that already, without it lock() only waits out fills, so interrupts are masked here and
+        // the fill checked again, one could have been started by an interrupt in between.
+        __force_inline uint32_t lock_rmw(uint32_t intr_state){
+#ifndef MYQSPI_PSRAM_USE_SPINLOCK
+            for(;;){
+                intr_state = save_and_disable_interrupts();
+                if(!fill_active) break;
+                restore_interrupts(intr_state);
+                intr_state = lock();
+            }
+#endif
+            return intr_state;
+        };
+
+        __force_inline void unlock_rmw(uint32_t intr_state){
+#ifdef MYQSPI_PSRAM_USE_SPINLOCK
+            unlock(intr_state);
+#else
+            restore_interrupts(intr_state);
+#endif
+        };
+
+        __force_inline void unlock(uint32_t intr_state){
+#ifdef MYQSPI_PSRAM_USE_QOS
+            // The last small access that got in ahead of a parked fill restarts it.
+            if(fill_parked && !qos_contended()) fill_resume();
+#endif
+#ifdef MYQSPI_PSRAM_USE_SPINLOCK
+            spin_unlock(psram_spinlock, intr_state);
+#else
+            (void)intr_state;
+#endif
+        };
 };
 
 #include "MyQSPI_PSRAM.hpp"
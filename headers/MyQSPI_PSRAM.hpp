@@ -25,6 +25,21 @@ data_pins(data_pins)
         _pio = pio2;
     }
     #endif 
+    initialized = false;
+    detected = false;
+    chain_pending = false;
+    fill_active = false;
+    fill_parked = false;
+#ifdef MYQSPI_PSRAM_USE_TRACE
+    trace_ring = nullptr;
+    trace_size = 0;
+    trace_enabled = false;
+    trace_head = 0;
+    trace_count = 0;
+#endif
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_len = 0;
+#endif
     clock_divider = find_clock_divisor();
     if(clock_divider == 2) {
         qspi_program = qspi_rw_2_nf_program;
@@ -35,55 +50,44 @@ data_pins(data_pins)
         qspi_wrap_target = qspi_rw_4_nf_wrap_target;
         qspi_wrap = qspi_rw_4_nf_wrap;
     }
+#ifdef MYQSPI_PSRAM_USE_QOS
+    qos_quantum = PSRAM_PAGE_SIZE;
+    qos_bytes = 0;
+    qos_served = 0;
+    reset_qos_stats();
+    for(uint32_t i = 0; i < NUM_CORES; ++i) qos_waiting[i] = 0;
+    set_qos_latency(MYQSPI_PSRAM_QOS_LATENCY_US);
+#endif
 }
 
+/// @brief Initialize the psram. The first call detects the chip, later calls reuse the cached size.
 MyQSPI_ERRORS MyQSPI_PSRAM::initPSRAM()
 {
     if(!clock_divider) {
         return MyQSPI_ERRORS::PSRAM_ERROR_COULD_NOT_FIND_SUITABLE_CLOCK_DIV;
     }
 
+    if(initialized) return reinit();
 
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t psram_spinlock_num = spin_lock_claim_unused(true);
-    psram_spinlock = spin_lock_init(psram_spinlock_num);
-#endif
-
-    pio_gpio_init(_pio, cs_sck_pins);
-    pio_gpio_init(_pio, cs_sck_pins + 1);
-    pio_gpio_init(_pio, data_pins);
-    pio_gpio_init(_pio, data_pins + 1);
-    pio_gpio_init(_pio, data_pins + 2);
-    pio_gpio_init(_pio, data_pins + 3);
-
-    gpio_set_slew_rate(cs_sck_pins, GPIO_SLEW_RATE_FAST);
-    gpio_set_slew_rate(cs_sck_pins + 1, GPIO_SLEW_RATE_FAST);    
-    gpio_set_slew_rate(data_pins, GPIO_SLEW_RATE_FAST);
-    gpio_set_slew_rate(data_pins + 1, GPIO_SLEW_RATE_FAST);
-    gpio_set_slew_rate(data_pins + 2, GPIO_SLEW_RATE_FAST);
-    gpio_set_slew_rate(data_pins + 3, GPIO_SLEW_RATE_FAST);
-
-    gpio_set_drive_strength(cs_sck_pins, GPIO_DRIVE_STRENGTH_12MA);
-    gpio_set_drive_strength(cs_sck_pins + 1, GPIO_DRIVE_STRENGTH_12MA);    
-    gpio_set_drive_strength(data_pins, GPIO_DRIVE_STRENGTH_12MA);
-    gpio_set_drive_strength(data_pins + 1, GPIO_DRIVE_STRENGTH_12MA);
-    gpio_set_drive_strength(data_pins + 2, GPIO_DRIVE_STRENGTH_12MA);
-    gpio_set_drive_strength(data_pins + 3, GPIO_DRIVE_STRENGTH_12MA);
+    // After a deinit() the size is known, the chip may be in either mode and gets reset once the qspi program runs.
+    bool first_init = !detected;
+    if(first_init){
+        busy_wait_us(150);
+        exit_quad_mode();
+    }
 
-    gpio_set_input_hysteresis_enabled(cs_sck_pins, false);
-    gpio_set_input_hysteresis_enabled(cs_sck_pins + 1, false);    
-    gpio_set_input_hysteresis_enabled(data_pins, false);
-    gpio_set_input_hysteresis_enabled(data_pins + 1, false);
-    gpio_set_input_hysteresis_enabled(data_pins + 2, false);
-    gpio_set_input_hysteresis_enabled(data_pins + 3, false);
+    setup_pins();
 
-    hw_set_bits(&_pio->input_sync_bypass, 0xfu << data_pins);
+    if(first_init){
+        MyQSPI_ERRORS error = detect();
+        if(error != MyQSPI_ERRORS::PSRAM_OK) return error;
+    }
 
-    uint qspi_offset = pio_add_program(_pio, &qspi_program);
+    qspi_offset = pio_add_program(_pio, &qspi_program);
 
     qspi_sm = pio_claim_unused_sm(_pio, true);
 
-    pio_sm_config qspi_sm_config = pio_get_default_sm_config();
+    qspi_sm_config = pio_get_default_sm_config();
 
     sm_config_set_wrap(&qspi_sm_config, qspi_offset + qspi_wrap_target, qspi_offset + qspi_wrap); 
     sm_config_set_sideset(&qspi_sm_config, 2, false, false);
@@ -98,170 +102,129 @@ MyQSPI_ERRORS MyQSPI_PSRAM::initPSRAM()
     sm_config_set_out_shift(&qspi_sm_config, false, true, 8);
     sm_config_set_in_shift(&qspi_sm_config, false, true, 8);
 
-    pio_sm_set_consecutive_pindirs(_pio, qspi_sm, cs_sck_pins, 2, true);
-    pio_sm_set_consecutive_pindirs(_pio, qspi_sm, data_pins, 4, false);
-
-    if(pio_sm_init(_pio, qspi_sm, qspi_offset, &qspi_sm_config) != PICO_OK) {
+    // Nothing stays claimed on failure, so a retry or another driver can have the resources.
+    if(start_qspi_sm() != PICO_OK) {
+        pio_sm_set_enabled(_pio, qspi_sm, false);
+        pio_remove_program_and_unclaim_sm(&qspi_program, _pio, qspi_sm, qspi_offset);
         return MyQSPI_ERRORS::PIO_ERROR_COULD_NOT_INITIALIZE;
     }
 
-    pio_sm_set_enabled(_pio, qspi_sm, true);
+#ifdef MYQSPI_PSRAM_USE_SPINLOCK
+    uint32_t psram_spinlock_num = spin_lock_claim_unused(true);
+    psram_spinlock = spin_lock_init(psram_spinlock_num);
+#endif
 
-    busy_wait_us(150);
+    dma_chan_read = dma_claim_unused_channel(true);
+    dma_chan_write = dma_claim_unused_channel(true);
+    dma_chan_header = dma_claim_unused_channel(true);
+    dma_chan_control = dma_claim_unused_channel(true);
 
-    pio_sm_put_blocking(_pio, qspi_sm, 0x02000000u);
-    pio_sm_put_blocking(_pio, qspi_sm, 0x00000000u);
-    pio_sm_put_blocking(_pio, qspi_sm, 0xF5000000u);
+    setup_dma();
 
-    pio_sm_set_enabled(_pio, qspi_sm, false);
-    pio_remove_program_and_unclaim_sm(&qspi_program, _pio, qspi_sm, qspi_offset);
+    fill_owner[dma_chan_header] = this;
+    if(!fill_irq_installed){
+        irq_add_shared_handler(DMA_IRQ_0 + MYQSPI_PSRAM_FILL_IRQ, fill_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(DMA_IRQ_0 + MYQSPI_PSRAM_FILL_IRQ, true);
+        fill_irq_installed = true;
+    }
 
-    uint spi_offset = pio_add_program(_pio, &spi_rw_program);
+    initialized = true;
 
-    uint spi_sm = pio_claim_unused_sm(_pio, true);
-    pio_sm_config spi_sm_config = pio_get_default_sm_config();
+    if(!first_init) reset_to_quad_mode();
 
-    sm_config_set_wrap(&spi_sm_config, spi_offset + spi_rw_wrap_target, spi_offset + spi_rw_wrap);
-    sm_config_set_sideset(&spi_sm_config, 2, false, false);
+    return MyQSPI_ERRORS::PSRAM_OK;
+}
 
-    sm_config_set_sideset_pins(&spi_sm_config, cs_sck_pins);
-    sm_config_set_out_pins(&spi_sm_config, data_pins, 1);
-    sm_config_set_in_pins(&spi_sm_config, data_pins+1);
+/// @brief Restore the pins, the state machine and the DMA channels after a sleep, the psram must have stayed powered.
+/// No psram commands and no waits, the chip is expected to still be in quad mode.
+MyQSPI_ERRORS MyQSPI_PSRAM::resume()
+{
+    if(!initialized) return initPSRAM();
 
-    sm_config_set_clkdiv(&spi_sm_config, 2);
+    pmemset_wait();
+    chain_pending = false;
 
-    sm_config_set_out_shift(&spi_sm_config, false, true, 8);
-    sm_config_set_in_shift(&spi_sm_config, false, true, 8);
+    setup_pins();
 
-    pio_sm_set_consecutive_pindirs(_pio, spi_sm, cs_sck_pins, 2, true);
-    pio_sm_set_consecutive_pindirs(_pio, spi_sm, data_pins, 1, true);
-    pio_sm_set_consecutive_pindirs(_pio, spi_sm, data_pins+1, 1, false);
+    // The instruction memory may have lost power, write the program back where it was claimed.
+    for(uint32_t i = 0; i < qspi_program.length; ++i){
+        uint16_t instr = qspi_program.instructions[i];
+        _pio->instr_mem[qspi_offset + i] = (_pio_major_instr_bits(instr) == pio_instr_bits_jmp) ? instr + qspi_offset : instr;
+    }
 
-    if(pio_sm_init(_pio, spi_sm, spi_offset, &spi_sm_config) != PICO_OK){
+    if(start_qspi_sm() != PICO_OK) {
         return MyQSPI_ERRORS::PIO_ERROR_COULD_NOT_INITIALIZE;
     }
-    pio_sm_set_enabled(_pio, spi_sm, true);
-
-    pio_sm_put_blocking(_pio, spi_sm, 0x08000000u);
-    pio_sm_put_blocking(_pio, spi_sm, 0x00000000u);
-    pio_sm_put_blocking(_pio, spi_sm, 0x66000000u);
-
-    busy_wait_us(10);
-
-    pio_sm_put_blocking(_pio, spi_sm, 0x08000000u);
-    pio_sm_put_blocking(_pio, spi_sm, 0x00000000u);
-    pio_sm_put_blocking(_pio, spi_sm, 0x99000000u);
-
-    busy_wait_us(150);
-
-    uint32_t kgd = 0, eid = 0;
-    pio_sm_put_blocking(_pio, spi_sm, 0x20000000u);
-    pio_sm_put_blocking(_pio, spi_sm, 0x30000000u);
-
-    pio_sm_put_blocking(_pio, spi_sm, 0x9F000000u);
-    for(int i = 0; i < 3; ++i) pio_sm_put_blocking(_pio, spi_sm, 0xFF000000u);
-
-    pio_sm_get_blocking(_pio, spi_sm);
-    kgd = pio_sm_get_blocking(_pio, spi_sm);
-    eid = pio_sm_get_blocking(_pio, spi_sm);
-    pio_sm_get_blocking(_pio, spi_sm);
-    pio_sm_get_blocking(_pio, spi_sm);
-    pio_sm_get_blocking(_pio, spi_sm);
 
-    if(kgd != 0x5D) return MyQSPI_ERRORS::PSRAM_ERROR_COULD_NOT_DETECT_PSRAM;
-
-    psram_size = 1024 * 1024;
-    uint8_t size_id = eid >> 5;
-    if (eid == 0x26 || size_id == 2) {
-        psram_size *= 8;
-    } else if (size_id == 0) {
-        psram_size *= 2;
-    } else if (size_id == 1) {
-        psram_size *= 4;
-    }
+    setup_dma();
 
-    busy_wait_us(2);
+    return MyQSPI_ERRORS::PSRAM_OK;
+}
 
-    pio_sm_put_blocking(_pio, spi_sm, 0x08000000u);
-    pio_sm_put_blocking(_pio, spi_sm, 0x00000000u);
-    
-    pio_sm_put_blocking(_pio, spi_sm, 0x35000000u);
+/// @brief Like resume(), but also resets the psram and puts it back into quad mode, for when it lost power or its mode is unknown.
+/// The psram must have been powered for at least 150us. Writes still held by write combining are dropped.
+MyQSPI_ERRORS MyQSPI_PSRAM::reinit()
+{
+    if(!initialized) return initPSRAM();
 
-    busy_wait_us(10);
-    
-    pio_sm_set_enabled(_pio, spi_sm, false);
-    pio_remove_program_and_unclaim_sm(&spi_rw_program, _pio, spi_sm, spi_offset);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_len = 0;
+#endif
 
-    qspi_offset = pio_add_program(_pio, &qspi_program);
+    MyQSPI_ERRORS error = resume();
+    if(error != MyQSPI_ERRORS::PSRAM_OK) return error;
 
-    qspi_sm = pio_claim_unused_sm(_pio, true);
+    reset_to_quad_mode();
 
-    qspi_sm_config = pio_get_default_sm_config();
+    return MyQSPI_ERRORS::PSRAM_OK;
+}
 
-    sm_config_set_wrap(&qspi_sm_config, qspi_offset + qspi_wrap_target, qspi_offset + qspi_wrap); 
-    sm_config_set_sideset(&qspi_sm_config, 2, false, false);
+/// @brief Release the pio program and state machine, the DMA channels and the spinlock. The detected size is kept,
+/// so a later initPSRAM() skips the detection. The pins stay assigned to the pio.
+void MyQSPI_PSRAM::deinit()
+{
+    if(!initialized) return;
 
-    sm_config_set_sideset_pins(&qspi_sm_config, cs_sck_pins);
-    sm_config_set_set_pins(&qspi_sm_config, data_pins, 4);
-    sm_config_set_out_pins(&qspi_sm_config, data_pins, 4);
-    sm_config_set_in_pins(&qspi_sm_config, data_pins);
-    
-    sm_config_set_clkdiv(&qspi_sm_config, 1);
+    pmemset_wait();
+    flush();
 
-    sm_config_set_out_shift(&qspi_sm_config, false, true, 8);
-    sm_config_set_in_shift(&qspi_sm_config, false, true, 8);
+    pio_sm_set_enabled(_pio, qspi_sm, false);
+    pio_remove_program_and_unclaim_sm(&qspi_program, _pio, qspi_sm, qspi_offset);
 
-    pio_sm_set_consecutive_pindirs(_pio, qspi_sm, cs_sck_pins, 2, true);
-    pio_sm_set_consecutive_pindirs(_pio, qspi_sm, data_pins, 4, false);
+    dma_irqn_set_channel_enabled(MYQSPI_PSRAM_FILL_IRQ, dma_chan_header, false);
+    fill_owner[dma_chan_header] = nullptr;
 
-    if(pio_sm_init(_pio, qspi_sm, qspi_offset, &qspi_sm_config) != PICO_OK) {
-        return MyQSPI_ERRORS::PIO_ERROR_COULD_NOT_INITIALIZE;
+    bool owners_left = false;
+    for(uint32_t i = 0; i < NUM_DMA_CHANNELS; ++i) owners_left |= fill_owner[i] != nullptr;
+    if(!owners_left && fill_irq_installed){
+        irq_remove_handler(DMA_IRQ_0 + MYQSPI_PSRAM_FILL_IRQ, fill_irq_handler);
+        fill_irq_installed = false;
     }
 
-    pio_sm_set_enabled(_pio, qspi_sm, true);
-
-    bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_DMA_R_BITS | BUSCTRL_BUS_PRIORITY_DMA_W_BITS;
-    
-    dma_chan_read = dma_claim_unused_channel(true);
-    dma_chan_write = dma_claim_unused_channel(true);
-
-    dma_write_config = dma_channel_get_default_config(dma_chan_write);
-
-    channel_config_set_transfer_data_size(&dma_write_config, DMA_SIZE_8);      
-
-    channel_config_set_read_increment(&dma_write_config, true);                        
-    channel_config_set_write_increment(&dma_write_config, false);    
-
-    channel_config_set_high_priority(&dma_write_config, true);     
-
-    channel_config_set_dreq(&dma_write_config, pio_get_dreq(_pio, qspi_sm, true));    
-    
-    dma_channel_set_config(dma_chan_write, &dma_write_config, false);
-    dma_channel_set_write_addr(dma_chan_write, &_pio->txf[qspi_sm], false);
-
-    dma_read_config = dma_channel_get_default_config(dma_chan_read);
-
-    channel_config_set_transfer_data_size(&dma_read_config, DMA_SIZE_8);     
+    dma_channel_unclaim(dma_chan_control);
+    dma_channel_unclaim(dma_chan_header);
+    dma_channel_unclaim(dma_chan_write);
+    dma_channel_unclaim(dma_chan_read);
+    chain_pending = false;
 
-    channel_config_set_read_increment(&dma_read_config, false);  
-    channel_config_set_write_increment(&dma_read_config, true);   
-
-    channel_config_set_high_priority(&dma_read_config, true);
-
-    channel_config_set_dreq(&dma_read_config, pio_get_dreq(_pio, qspi_sm, false));  
-    
-    dma_channel_set_config(dma_chan_read, &dma_read_config, false);
-    dma_channel_set_read_addr(dma_chan_read, &_pio->rxf[qspi_sm], false);
+#ifdef MYQSPI_PSRAM_USE_SPINLOCK
+    spin_lock_unclaim(spin_lock_get_num(psram_spinlock));
+#endif
 
-    return MyQSPI_ERRORS::PSRAM_OK;
+    initialized = false;
 }
 
 /// @brief Write 1 byte of data to the psram.
 /// @param addr Write address. 
 /// @param data Data.
 void MyQSPI_PSRAM::write8(uint32_t addr, uint8_t data){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 1);
+    trace(MyQSPI_TRACE_OP::WRITE8, addr, 1);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    if(combine_write(addr, reinterpret_cast<const uint8_t*>(&data), sizeof(data))){
+        unlock(intr_state);
+        return;
+    }
 #endif
 
     buffer[2+0] = 5*2-1;
@@ -278,17 +241,20 @@ void MyQSPI_PSRAM::write8(uint32_t addr, uint8_t data){
     dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 7);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
 
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
-#endif
+    unlock(intr_state);
 }
 
 /// @brief Write 2 bytes of data to the psram.
 /// @param addr Write address. 
 /// @param data Data.
 void MyQSPI_PSRAM::write16(uint32_t addr, uint16_t data){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 2);
+    trace(MyQSPI_TRACE_OP::WRITE16, addr, 2);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    if(combine_write(addr, reinterpret_cast<const uint8_t*>(&data), sizeof(data))){
+        unlock(intr_state);
+        return;
+    }
 #endif
 
     buffer[2+0] = 6*2-1;
@@ -304,16 +270,19 @@ void MyQSPI_PSRAM::write16(uint32_t addr, uint16_t data){
     
     dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 8);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
-#endif
+    unlock(intr_state);
 }
 /// @brief Write 4 bytes of data to the psram.
 /// @param addr Write address. 
 /// @param data Data.
 void MyQSPI_PSRAM::write32(uint32_t addr, uint32_t data){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK    
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 4);
+    trace(MyQSPI_TRACE_OP::WRITE32, addr, 4);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    if(combine_write(addr, reinterpret_cast<const uint8_t*>(&data), sizeof(data))){
+        unlock(intr_state);
+        return;
+    }
 #endif
     buffer[2+0] = 8*2-1;
     buffer[2+1] = 0;
@@ -328,17 +297,20 @@ void MyQSPI_PSRAM::write32(uint32_t addr, uint32_t data){
     
     dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 10);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK    
-    spin_unlock(psram_spinlock, intr_state);
-#endif
+    unlock(intr_state);
 }
 
 /// @brief Write 8 bytes of data to the psram.
 /// @param addr Write address. 
 /// @param data Data.
 void MyQSPI_PSRAM::write64(uint32_t addr, uint64_t data){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK    
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 8);
+    trace(MyQSPI_TRACE_OP::WRITE64, addr, 8);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    if(combine_write(addr, reinterpret_cast<const uint8_t*>(&data), sizeof(data))){
+        unlock(intr_state);
+        return;
+    }
 #endif
     buffer[2+0] = 12*2-1;
     buffer[2+1] = 0;
@@ -353,17 +325,17 @@ void MyQSPI_PSRAM::write64(uint32_t addr, uint64_t data){
     
     dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 14);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
-#endif
+    unlock(intr_state);
 }
 
 /// @brief Write 64 bytes of data to the psram.
 /// @param addr Write address. 
 /// @param data Pointer to the data. Make sure it's 64 bytes of length. 
 void MyQSPI_PSRAM::write512(uint32_t addr, const uint8_t* data){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 64);
+    trace(MyQSPI_TRACE_OP::WRITE512, addr, 64);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, 64);
 #endif
     buffer[2+0] = 68*2-1;
     buffer[2+1] = 0;
@@ -378,61 +350,69 @@ void MyQSPI_PSRAM::write512(uint32_t addr, const uint8_t* data){
     
     dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 70);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
-#endif
+    unlock(intr_state);
 }
 
+/// @brief Write a block of data .
+/// @param addr Write address.
+/// @param data Pointer to the data buffer.
+/// @param data_len Length of the data buffer.
 void MyQSPI_PSRAM::write(uint32_t addr, const uint8_t *data, uint32_t data_len){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock();
+    trace(MyQSPI_TRACE_OP::WRITE, addr, data_len);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, data_len);
 #endif
-    uint32_t current_data_pos = 0;
-    while(data_len > 124u){
-        buffer[2+0] = 255;
-        buffer[2+1] = 0;
-        
-        buffer[2+2] = 0x38u;
-
-        buffer[2+3] = (addr >> 16) & 0xFFu;
-        buffer[2+4] = (addr >> 8) & 0xFFu;
-        buffer[2+5] = (addr) & 0xFFu;
-
-        memcpy(buffer+8, data+current_data_pos, 124);
-
-        dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 130);
-        dma_channel_wait_for_finish_blocking(dma_chan_write);
+    // Header and payload go out on chained channels, so the payload streams straight from data
+    // and the next header is built while the current chunk is still being sent.
+    // Chunks end at page boundaries, a burst crossing one would wrap around within the page.
+    uint32_t slot = 0;
+    while(data_len){
+        uint32_t chunk_len = data_len > 124u ? 124u : data_len;
+        if(chunk_len > PSRAM_PAGE_SIZE - addr % PSRAM_PAGE_SIZE) chunk_len = PSRAM_PAGE_SIZE - addr % PSRAM_PAGE_SIZE;
+#ifdef MYQSPI_PSRAM_USE_QOS
+        if(chunk_len > qos_quantum) chunk_len = qos_quantum;
+        if(qos_due(chunk_len)){
+            wait_for_chain();
+            intr_state = qos_handover(intr_state);
+        }
+#endif
+        uint8_t* header = header_buffer + slot*8u;
 
-        addr += 124u;
-        data_len -= 124u;
-        current_data_pos += 124u;
-    }
+        header[0] = 4u*2u+chunk_len*2u-1u;
+        header[1] = 0u;
 
-    buffer[2+0] = 4u*2u+data_len*2u-1u;
-    buffer[2+1] = 0u;
-    
-    buffer[2+2] = 0x38u;
+        header[2] = 0x38u;
 
-    buffer[2+3] = (addr >> 16) & 0xFFu;
-    buffer[2+4] = (addr >> 8) & 0xFFu;
-    buffer[2+5] = (addr) & 0xFFu;
+        header[3] = (addr >> 16) & 0xFFu;
+        header[4] = (addr >> 8) & 0xFFu;
+        header[5] = (addr) & 0xFFu;
 
-    memcpy(buffer+8, data+current_data_pos, data_len);
+        wait_for_chain();
+        start_chain(header, data, chunk_len);
 
-    dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 6+data_len);
-    dma_channel_wait_for_finish_blocking(dma_chan_write);
+        addr += chunk_len;
+        data += chunk_len;
+        data_len -= chunk_len;
+        slot ^= 1u;
+    }
+    wait_for_chain();
 
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
-#endif
+    unlock(intr_state);
 }
 
 /// @brief Read 1 byte of data from the psram.
 /// @param addr Read address.
 /// @param data Data.
 uint8_t MyQSPI_PSRAM::read8(uint32_t addr){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 1);
+    trace(MyQSPI_TRACE_OP::READ8, addr, 1);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    uint8_t combined;
+    if(combine_read(addr, reinterpret_cast<uint8_t*>(&combined), sizeof(combined))){
+        unlock(intr_state);
+        return combined;
+    }
 #endif
     
     buffer[2+0] = 4*2-1;
@@ -448,21 +428,23 @@ uint8_t MyQSPI_PSRAM::read8(uint32_t addr){
     dma_channel_transfer_to_buffer_now(dma_chan_read, buffer+8, 1);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
     dma_channel_wait_for_finish_blocking(dma_chan_read);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
     uint8_t tmp = buffer[2+6];
-    spin_unlock(psram_spinlock, intr_state);
+    unlock(intr_state);
     return tmp;
-#else
-    return buffer[2+6];
-#endif
 }
 
 /// @brief Read 2 bytes of data from the psram.
 /// @param addr Read address. 
 /// @param data Data.
 uint16_t MyQSPI_PSRAM::read16(uint32_t addr){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 2);
+    trace(MyQSPI_TRACE_OP::READ16, addr, 2);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    uint16_t combined;
+    if(combine_read(addr, reinterpret_cast<uint8_t*>(&combined), sizeof(combined))){
+        unlock(intr_state);
+        return combined;
+    }
 #endif
     buffer[2+0] = 4*2-1;
     buffer[2+1] = 4-1;
@@ -477,21 +459,23 @@ uint16_t MyQSPI_PSRAM::read16(uint32_t addr){
     dma_channel_transfer_to_buffer_now(dma_chan_read, buffer+8, 2);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
     dma_channel_wait_for_finish_blocking(dma_chan_read);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
     uint16_t tmp = *(reinterpret_cast<uint16_t*>(&buffer[2+6]));
-    spin_unlock(psram_spinlock, intr_state);
+    unlock(intr_state);
     return tmp;
-#else
-    return *(reinterpret_cast<uint16_t*>(&buffer[2+6]));
-#endif
 }
 
 /// @brief Read 4 bytes of data from the psram.
 /// @param addr Read address. 
 /// @param data Data.
 uint32_t MyQSPI_PSRAM::read32(uint32_t addr){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 4);
+    trace(MyQSPI_TRACE_OP::READ32, addr, 4);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    uint32_t combined;
+    if(combine_read(addr, reinterpret_cast<uint8_t*>(&combined), sizeof(combined))){
+        unlock(intr_state);
+        return combined;
+    }
 #endif
     buffer[2+0] = 4*2-1;
     buffer[2+1] = 8-1;
@@ -506,21 +490,23 @@ uint32_t MyQSPI_PSRAM::read32(uint32_t addr){
     dma_channel_transfer_to_buffer_now(dma_chan_read, buffer+8, 4);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
     dma_channel_wait_for_finish_blocking(dma_chan_read);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
     uint32_t tmp = *(reinterpret_cast<uint32_t*>(&buffer[2+6]));
-    spin_unlock(psram_spinlock, intr_state);
+    unlock(intr_state);
     return tmp;
-#else
-    return *(reinterpret_cast<uint32_t*>(&buffer[2+6]));
-#endif
 }
 
 /// @brief Read 8 bytes of data from the psram.
 /// @param addr Read address. 
 /// @param data Data.
 uint64_t MyQSPI_PSRAM::read64(uint32_t addr){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 8);
+    trace(MyQSPI_TRACE_OP::READ64, addr, 8);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    uint64_t combined;
+    if(combine_read(addr, reinterpret_cast<uint8_t*>(&combined), sizeof(combined))){
+        unlock(intr_state);
+        return combined;
+    }
 #endif
 
     buffer[2+0] = 4*2-1;
@@ -536,21 +522,22 @@ uint64_t MyQSPI_PSRAM::read64(uint32_t addr){
     dma_channel_transfer_to_buffer_now(dma_chan_read, buffer+8, 8);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
     dma_channel_wait_for_finish_blocking(dma_chan_read);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
     uint64_t tmp = *(reinterpret_cast<uint64_t*>(&buffer[2+6]));
-    spin_unlock(psram_spinlock, intr_state);
+    unlock(intr_state);
     return tmp;
-#else
-    return *(reinterpret_cast<uint64_t*>(&buffer[2+6]));
-#endif
 }
 
 /// @brief Read 64 bytes of data from the psram.
 /// @param addr Read address.
 /// @param data Pointer to the read buffer. Make sure it's at least 64 bytes of length
 void MyQSPI_PSRAM::read512(uint32_t addr, uint8_t* data){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock_priority(addr, 64);
+    trace(MyQSPI_TRACE_OP::READ512, addr, 64);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    if(combine_read(addr, data, 64)){
+        unlock(intr_state);
+        return;
+    }
 #endif
 
     buffer[2+0] = 4*2-1;
@@ -566,158 +553,1034 @@ void MyQSPI_PSRAM::read512(uint32_t addr, uint8_t* data){
     dma_channel_transfer_to_buffer_now(dma_chan_read, data, 64);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
     dma_channel_wait_for_finish_blocking(dma_chan_read);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
-#endif
+    unlock(intr_state);
 }
 
 /// @brief Read a block of data .
 /// @param addr Read address.
 /// @param data Pointer to the read buffer, must be at least data_len bytes long.
-/// @param data_len Length of the data to be read. MAX is 2048
+/// @param data_len Length of the data to be read.
 void MyQSPI_PSRAM::read(uint32_t addr, uint8_t* data, const uint32_t data_len){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock();
+    trace(MyQSPI_TRACE_OP::READ, addr, data_len);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    if(combine_read(addr, data, data_len)){
+        unlock(intr_state);
+        return;
+    }
 #endif
+    if(!data_len){
+        unlock(intr_state);
+        return;
+    }
+
+    // The read channel takes the whole transfer, or a quantum of it with qos, headers are streamed
+    // in batches from alternating halves of buffer while the previous batch is being sent.
+    // Chunks end at page boundaries, a burst crossing one would wrap around within the page.
     uint32_t local_data_len = data_len;
-    uint32_t current_pos = 2;
-    while(local_data_len > 128){
-        buffer[current_pos++] = 4u*2u-1u;
-        buffer[current_pos++] = 255u;
+    while(local_data_len){
+        uint32_t segment_len = local_data_len;
+#ifdef MYQSPI_PSRAM_USE_QOS
+        if(segment_len > qos_quantum) segment_len = qos_quantum;
+#endif
+        intr_state = qos_yield(intr_state, segment_len);
 
-        buffer[current_pos++] = 0xEBu;
-        
-        buffer[current_pos++] = (addr >> 16) & 0xFFu;
-        buffer[current_pos++] = (addr >> 8) & 0xFFu;
-        buffer[current_pos++] = (addr) & 0xFFu;
+        dma_channel_transfer_to_buffer_now(dma_chan_read, data, segment_len);
 
-        local_data_len -= 128u;
-        addr += 128u;
-    }
-    buffer[current_pos++] = 4*2-1;
-    buffer[current_pos++] = local_data_len*2u-1u;
+        local_data_len -= segment_len;
+        data += segment_len;
 
-    buffer[current_pos++] = 0xEBu;
-    
-    buffer[current_pos++] = (addr >> 16) & 0xFFu;
-    buffer[current_pos++] = (addr >> 8) & 0xFFu;
-    buffer[current_pos++] = (addr) & 0xFFu;
+        uint8_t* batch = buffer+2;
+        while(segment_len){
+            uint32_t current_pos = 0;
+            while(segment_len && current_pos < 60u){
+                uint32_t chunk_len = segment_len > 128u ? 128u : segment_len;
+                if(chunk_len > PSRAM_PAGE_SIZE - addr % PSRAM_PAGE_SIZE) chunk_len = PSRAM_PAGE_SIZE - addr % PSRAM_PAGE_SIZE;
 
-    dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, current_pos-2);
-    dma_channel_transfer_to_buffer_now(dma_chan_read, data, data_len);
-    dma_channel_wait_for_finish_blocking(dma_chan_write);
-    dma_channel_wait_for_finish_blocking(dma_chan_read);
+                batch[current_pos++] = 4u*2u-1u;
+                batch[current_pos++] = chunk_len*2u-1u;
 
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
-#endif
-}
+                batch[current_pos++] = 0xEBu;
 
-void MyQSPI_PSRAM::pmemset(uint32_t addr, uint8_t val, uint32_t size){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
-#endif
-    memset(buffer+8, val, 124);
-    uint32_t current_data_pos = 0;
-    while(size > 124u){
-        buffer[2+0] = 255;
-        buffer[2+1] = 0;
-        
-        buffer[2+2] = 0x38u;
+                batch[current_pos++] = (addr >> 16) & 0xFFu;
+                batch[current_pos++] = (addr >> 8) & 0xFFu;
+                batch[current_pos++] = (addr) & 0xFFu;
 
-        buffer[2+3] = (addr >> 16) & 0xFFu;
-        buffer[2+4] = (addr >> 8) & 0xFFu;
-        buffer[2+5] = (addr) & 0xFFu;
+                segment_len -= chunk_len;
+                addr += chunk_len;
+            }
 
-        dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 130);
-        dma_channel_wait_for_finish_blocking(dma_chan_write);
+            dma_channel_wait_for_finish_blocking(dma_chan_write);
+            dma_channel_transfer_from_buffer_now(dma_chan_write, batch, current_pos);
 
-        addr += 124u;
-        size -= 124u;
-        current_data_pos += 124u;
+            batch = (batch == buffer+2) ? buffer+66 : buffer+2;
+        }
+        dma_channel_wait_for_finish_blocking(dma_chan_write);
+        dma_channel_wait_for_finish_blocking(dma_chan_read);
     }
 
-    buffer[2+0] = 4u*2u+size*2u-1u;
-    buffer[2+1] = 0u;
-    
-    buffer[2+2] = 0x38u;
+    unlock(intr_state);
+}
 
-    buffer[2+3] = (addr >> 16) & 0xFFu;
-    buffer[2+4] = (addr >> 8) & 0xFFu;
-    buffer[2+5] = (addr) & 0xFFu;
+/// @brief Write a value across a block of memory.
+/// @param addr Address of the first byte.
+/// @param val Value to write.
+/// @param size Size of the block to write.
+void MyQSPI_PSRAM::pmemset(uint32_t addr, uint8_t val, uint32_t size){
+    uint32_t intr_state = lock();
+    trace(MyQSPI_TRACE_OP::PMEMSET, addr, size);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, size);
+#endif
+    fill(intr_state, addr, val, 1, size);
+    unlock(intr_state);
+}
 
-    dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 6+size);
-    dma_channel_wait_for_finish_blocking(dma_chan_write);
+/// @brief Write a 16 bit pattern across a block of memory.
+/// @param addr Address of the first byte.
+/// @param val Pattern to write, low byte goes to addr.
+/// @param size Size of the block to write in bytes.
+void MyQSPI_PSRAM::pmemset16(uint32_t addr, uint16_t val, uint32_t size){
+    uint32_t intr_state = lock();
+    trace(MyQSPI_TRACE_OP::PMEMSET, addr, size);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, size);
+#endif
+    fill(intr_state, addr, val, 2, size);
+    unlock(intr_state);
+}
 
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
+/// @brief Write a 32 bit pattern across a block of memory.
+/// @param addr Address of the first byte.
+/// @param val Pattern to write, low byte goes to addr.
+/// @param size Size of the block to write in bytes.
+void MyQSPI_PSRAM::pmemset32(uint32_t addr, uint32_t val, uint32_t size){
+    uint32_t intr_state = lock();
+    trace(MyQSPI_TRACE_OP::PMEMSET, addr, size);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, size);
 #endif
+    fill(intr_state, addr, val, 4, size);
+    unlock(intr_state);
+}
+
+/// @brief Start filling a block of memory in the background.
+/// @param addr Address of the first byte.
+/// @param val Pattern to write, low byte goes to addr.
+/// @param val_size Size of the pattern in bytes, 1, 2 or 4.
+/// @param size Size of the block to write in bytes.
+/// @return false if val_size is not 1, 2 or 4, nothing is written then.
+bool MyQSPI_PSRAM::pmemset_async(uint32_t addr, uint32_t val, uint8_t val_size, uint32_t size){
+    if(val_size != 1 && val_size != 2 && val_size != 4) return false;
+
+    uint32_t intr_state = lock();
+    trace(MyQSPI_TRACE_OP::PMEMSET, addr, size);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, size);
+#endif
+    if(size){
+        fill_start(addr, val, val_size, size);
+        dma_irqn_set_channel_enabled(MYQSPI_PSRAM_FILL_IRQ, dma_chan_header, true);
+        fill_next_batch();
+    }
+    unlock(intr_state);
+    return true;
+}
+
+/// @brief Wait for a fill started with pmemset_async() to finish.
+void MyQSPI_PSRAM::pmemset_wait(){
+    while(fill_active || fill_parked) tight_loop_contents();
 }
 
 void MyQSPI_PSRAM::pmemcpy(uint32_t addr_dst, uint32_t addr_src, uint32_t size){
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    uint32_t  intr_state = spin_lock_blocking(psram_spinlock);
+    uint32_t intr_state = lock();
+    trace(MyQSPI_TRACE_OP::PMEMCPY, addr_dst, size);
+    trace(MyQSPI_TRACE_OP::PMEMCPY_SRC, addr_src, size);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr_src, size);
+    combine_flush_overlap(addr_dst, size);
+#endif
+    // Chunks end at the page boundaries of both source and destination.
+    while(size){
+        uint32_t chunk_len = size > 124u ? 124u : size;
+        if(chunk_len > PSRAM_PAGE_SIZE - addr_src % PSRAM_PAGE_SIZE) chunk_len = PSRAM_PAGE_SIZE - addr_src % PSRAM_PAGE_SIZE;
+        if(chunk_len > PSRAM_PAGE_SIZE - addr_dst % PSRAM_PAGE_SIZE) chunk_len = PSRAM_PAGE_SIZE - addr_dst % PSRAM_PAGE_SIZE;
+#ifdef MYQSPI_PSRAM_USE_QOS
+        // Each byte crosses the bus twice.
+        if(chunk_len > qos_quantum / 2u) chunk_len = qos_quantum / 2u;
 #endif
-    while(size > 124u){
-        buffer[2+0] = 4u*2u-1u;
-        buffer[2+1] = 124u*2u-1u;
-        
-        buffer[2+2] = 0xEBu;
+        intr_state = qos_yield(intr_state, 2u*chunk_len);
 
-        buffer[2+3] = (addr_src >> 16) & 0xFFu;
-        buffer[2+4] = (addr_src >> 8) & 0xFFu;
-        buffer[2+5] = (addr_src) & 0xFFu;
+        stage_read(addr_src, chunk_len);
+        stage_write(addr_dst, chunk_len);
 
-        dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 6);
-        dma_channel_transfer_to_buffer_now(dma_chan_read, buffer+8, 124);
-        dma_channel_wait_for_finish_blocking(dma_chan_read);
-        dma_channel_wait_for_finish_blocking(dma_chan_write);
+        addr_src += chunk_len;
+        addr_dst += chunk_len;
+        size -= chunk_len;
+    }
+    unlock(intr_state);
+}
+
+/// @brief Replace a word if it holds the expected value, with one locked read and write.
+/// @param addr Address of the word, must not cross a page.
+/// @param expected Expected value, set to the current value if they differ.
+/// @param desired Value to write.
+/// @return true if the word was replaced.
+bool MyQSPI_PSRAM::compare_exchange(uint32_t addr, uint32_t& expected, uint32_t desired){
+    uint32_t intr_state = lock_rmw(lock_priority(addr, 4));
+    trace(MyQSPI_TRACE_OP::READ32, addr, 4);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, 4);
+#endif
+    stage_read(addr, 4);
 
-        buffer[2+0] = 255;
-        buffer[2+1] = 0;
-        
-        buffer[2+2] = 0x38u;
+    uint32_t* word = reinterpret_cast<uint32_t*>(buffer+8);
+    if(*word != expected){
+        expected = *word;
+        unlock_rmw(intr_state);
+        return false;
+    }
 
-        buffer[2+3] = (addr_dst >> 16) & 0xFFu;
-        buffer[2+4] = (addr_dst >> 8) & 0xFFu;
-        buffer[2+5] = (addr_dst) & 0xFFu;
+    trace(MyQSPI_TRACE_OP::WRITE32, addr, 4);
+    *word = desired;
+    stage_write(addr, 4);
 
-        dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 130);
-        dma_channel_wait_for_finish_blocking(dma_chan_write);
+    unlock_rmw(intr_state);
+    return true;
+}
+
+/// @brief Apply an operation to consecutive words, e.g. histogram bins or bitmap words.
+/// Every 124 bytes take one burst read and one burst write, and each page is updated atomically.
+/// Without MYQSPI_PSRAM_USE_SPINLOCK interrupts stay off for the whole call.
+/// @param op Operation.
+/// @param addr Address of the first word, 4 byte aligned.
+/// @param vals One operand per word.
+/// @param count Number of words.
+/// @param old_vals Receives the values before the update (optional).
+void MyQSPI_PSRAM::update_words(MyQSPI_RMW_OP op, uint32_t addr, const uint32_t* vals, uint32_t count, uint32_t* old_vals){
+    uint32_t intr_state = lock_rmw(lock());
+    trace(MyQSPI_TRACE_OP::READ, addr, count*4u);
+    trace(MyQSPI_TRACE_OP::WRITE, addr, count*4u);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, count*4u);
+#endif
+    uint32_t* words = reinterpret_cast<uint32_t*>(buffer+8);
+    uint32_t page = UINT32_MAX;
+
+    while(count){
+        // With qos the lock is only handed over before a page, so a page is never seen half updated.
+        if(addr / PSRAM_PAGE_SIZE != page){
+            page = addr / PSRAM_PAGE_SIZE;
+            uint32_t page_len = PSRAM_PAGE_SIZE - addr % PSRAM_PAGE_SIZE;
+            if(page_len > count*4u) page_len = count*4u;
+            intr_state = qos_yield(intr_state, 2u*page_len);
+        }
+
+        // Pieces stop at the page end, the psram would wrap around within the page otherwise.
+        uint32_t piece = (PSRAM_PAGE_SIZE - addr % PSRAM_PAGE_SIZE) / 4u;
+        if(piece > 124u/4u) piece = 124u/4u;
+        if(piece > count) piece = count;
+        if(!piece) piece = 1;
+
+        stage_read(addr, piece*4u);
+
+        bool changed = false;
+        for(uint32_t i = 0; i < piece; ++i){
+            uint32_t old_val = words[i];
+            if(old_vals) old_vals[i] = old_val;
+
+            words[i] = rmw_apply(op, old_val, vals[i]);
+            changed |= words[i] != old_val;
+        }
+        if(changed) stage_write(addr, piece*4u);
+
+        addr += piece*4u;
+        vals += piece;
+        if(old_vals) old_vals += piece;
+        count -= piece;
+    }
+
+    unlock_rmw(intr_state);
+}
+
+/// @brief Issue the pending combined writes.
+void MyQSPI_PSRAM::flush(){
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    uint32_t intr_state = lock();
+    trace(MyQSPI_TRACE_OP::FLUSH, combine_addr, combine_len);
+    combine_flush();
+    unlock(intr_state);
+#endif
+}
+
+#ifdef MYQSPI_PSRAM_USE_TRACE
+/// @brief Start recording calls into a ring, the oldest records are overwritten once it's full.
+/// @param ring Record storage, must stay valid until trace_dump() returned.
+/// @param ring_len Number of records in ring.
+void MyQSPI_PSRAM::trace_start(MyQSPI_TraceRecord* ring, uint32_t ring_len){
+    uint32_t intr_state = lock();
+    trace_head = 0;
+    trace_count = 0;
+    trace_size = ring_len;
+    trace_ring = ring;
+    trace_enabled = ring_len != 0;
+    unlock(intr_state);
+}
+
+/// @brief Stop recording, the recorded calls stay available for trace_dump().
+void MyQSPI_PSRAM::trace_stop(){
+    uint32_t intr_state = lock();
+    trace_enabled = false;
+    unlock(intr_state);
+}
+
+/// @brief Stop recording and write a MyQSPI_TraceHeader followed by the records, oldest first.
+/// @param out Called with consecutive pieces of the dump, e.g. a wrapper around fwrite to stdout.
+void MyQSPI_PSRAM::trace_dump(void (*out)(const uint8_t* data, uint32_t len)){
+    // The recorder is stopped under the lock, so the ring can't change while out() runs.
+    uint32_t intr_state = lock();
+    trace_enabled = false;
+    MyQSPI_TraceRecord* ring = trace_ring;
+    uint32_t ring_len = trace_size;
+    uint32_t head = trace_head;
+    uint32_t count = trace_count;
+    unlock(intr_state);
+
+    if(!ring || !ring_len) return;
+
+    uint32_t stored = count < ring_len ? count : ring_len;
+
+    MyQSPI_TraceHeader header = {MYQSPI_TRACE_MAGIC, MYQSPI_TRACE_VERSION, stored, count - stored};
+    out(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+
+    uint32_t first = (head + ring_len - stored) % ring_len;
+    if(first + stored <= ring_len){
+        out(reinterpret_cast<const uint8_t*>(ring + first), stored * sizeof(MyQSPI_TraceRecord));
+    }else{
+        out(reinterpret_cast<const uint8_t*>(ring + first), (ring_len - first) * sizeof(MyQSPI_TraceRecord));
+        out(reinterpret_cast<const uint8_t*>(ring), (stored - ring_len + first) * sizeof(MyQSPI_TraceRecord));
+    }
+}
+#endif // MYQSPI_PSRAM_USE_TRACE
+
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+bool MyQSPI_PSRAM::combine_write(uint32_t addr, const uint8_t* data, uint32_t data_len){
+    if(combine_len){
+        uint32_t combine_end = combine_addr + combine_len;
+        uint32_t new_end = addr + data_len;
+        if(new_end < combine_end) new_end = combine_end;
+
+        if(addr >= combine_addr && addr <= combine_end
+        && new_end - combine_addr <= MYQSPI_PSRAM_COMBINE_SIZE
+        && (new_end - 1u) / PSRAM_PAGE_SIZE == combine_addr / PSRAM_PAGE_SIZE){
+            memcpy(combine_buffer+8+(addr-combine_addr), data, data_len);
+            combine_len = new_end - combine_addr;
+
+            if(combine_len == MYQSPI_PSRAM_COMBINE_SIZE || new_end % PSRAM_PAGE_SIZE == 0) combine_flush();
+            return true;
+        }
+        combine_flush();
+    }
+
+    // Writes crossing a page go out directly, as they would without combining.
+    if(addr / PSRAM_PAGE_SIZE != (addr + data_len - 1u) / PSRAM_PAGE_SIZE) return false;
+
+    combine_addr = addr;
+    combine_len = data_len;
+    memcpy(combine_buffer+8, data, data_len);
+
+    if((addr + data_len) % PSRAM_PAGE_SIZE == 0) combine_flush();
+    return true;
+}
+
+bool MyQSPI_PSRAM::combine_read(uint32_t addr, uint8_t* data, uint32_t data_len){
+    if(!combine_overlaps(addr, data_len)) return false;
+
+    if(addr >= combine_addr && addr + data_len <= combine_addr + combine_len){
+        memcpy(data, combine_buffer+8+(addr-combine_addr), data_len);
+        return true;
+    }
+
+    combine_flush();
+    return false;
+}
+
+void MyQSPI_PSRAM::combine_flush(){
+    if(!combine_len) return;
 
-        addr_src += 124u;
-        addr_dst += 124u;
-        size -= 124u;
+    combine_buffer[2+0] = 4u*2u+combine_len*2u-1u;
+    combine_buffer[2+1] = 0u;
+
+    combine_buffer[2+2] = 0x38u;
+
+    combine_buffer[2+3] = (combine_addr >> 16) & 0xFFu;
+    combine_buffer[2+4] = (combine_addr >> 8) & 0xFFu;
+    combine_buffer[2+5] = (combine_addr) & 0xFFu;
+
+    dma_channel_transfer_from_buffer_now(dma_chan_write, combine_buffer+2, 6+combine_len);
+    dma_channel_wait_for_finish_blocking(dma_chan_write);
+
+    combine_len = 0;
+}
+
+void MyQSPI_PSRAM::combine_flush_overlap(uint32_t addr, uint32_t data_len){
+    if(combine_overlaps(addr, data_len)) combine_flush();
+}
+#endif // MYQSPI_PSRAM_USE_WRITE_COMBINING
+
+// One word read and written under a single lock, the write is skipped if the value didn't change.
+uint32_t MyQSPI_PSRAM::fetch_op(MyQSPI_RMW_OP op, uint32_t addr, uint32_t val){
+    uint32_t intr_state = lock_rmw(lock_priority(addr, 4));
+    trace(MyQSPI_TRACE_OP::READ32, addr, 4);
+#ifdef MYQSPI_PSRAM_USE_WRITE_COMBINING
+    combine_flush_overlap(addr, 4);
+#endif
+    stage_read(addr, 4);
+
+    uint32_t* word = reinterpret_cast<uint32_t*>(buffer+8);
+    uint32_t old_val = *word;
+    *word = rmw_apply(op, old_val, val);
+    if(*word != old_val){
+        trace(MyQSPI_TRACE_OP::WRITE32, addr, 4);
+        stage_write(addr, 4);
     }
 
+    unlock_rmw(intr_state);
+    return old_val;
+}
+
+// Reads len bytes, 124 at most, into buffer+8 so stage_write() can send them out again behind a header.
+void MyQSPI_PSRAM::stage_read(uint32_t addr, uint32_t len){
     buffer[2+0] = 4u*2u-1u;
-    buffer[2+1] = size*2u-1u;
-    
+    buffer[2+1] = len*2u-1u;
+
     buffer[2+2] = 0xEBu;
 
-    buffer[2+3] = (addr_src >> 16) & 0xFFu;
-    buffer[2+4] = (addr_src >> 8) & 0xFFu;
-    buffer[2+5] = (addr_src) & 0xFFu;
+    buffer[2+3] = (addr >> 16) & 0xFFu;
+    buffer[2+4] = (addr >> 8) & 0xFFu;
+    buffer[2+5] = (addr) & 0xFFu;
 
     dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 6);
-    dma_channel_transfer_to_buffer_now(dma_chan_read, buffer+8, size);
+    dma_channel_transfer_to_buffer_now(dma_chan_read, buffer+8, len);
     dma_channel_wait_for_finish_blocking(dma_chan_read);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
+}
 
-    buffer[2+0] = 4u*2u+size*2u-1u;
+void MyQSPI_PSRAM::stage_write(uint32_t addr, uint32_t len){
+    buffer[2+0] = 4u*2u+len*2u-1u;
     buffer[2+1] = 0;
-    
+
     buffer[2+2] = 0x38u;
 
-    buffer[2+3] = (addr_dst >> 16) & 0xFFu;
-    buffer[2+4] = (addr_dst >> 8) & 0xFFu;
-    buffer[2+5] = (addr_dst) & 0xFFu;
+    buffer[2+3] = (addr >> 16) & 0xFFu;
+    buffer[2+4] = (addr >> 8) & 0xFFu;
+    buffer[2+5] = (addr) & 0xFFu;
 
-    dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 6+size);
+    dma_channel_transfer_from_buffer_now(dma_chan_write, buffer+2, 6+len);
     dma_channel_wait_for_finish_blocking(dma_chan_write);
-#ifdef MYQSPI_PSRAM_USE_SPINLOCK
-    spin_unlock(psram_spinlock, intr_state);
+}
+
+#ifdef MYQSPI_PSRAM_USE_QOS
+/// @brief Set how long a small access may wait behind write(), read(), pmemset() or pmemcpy().
+/// Those are split into quanta that take about that long on the bus, a page at most.
+/// update_words() only hands over between pages.
+/// @param latency_us Wait bound in microseconds, on top of the small access itself.
+/// @return Quantum in bytes.
+uint32_t MyQSPI_PSRAM::set_qos_latency(uint32_t latency_us){
+    if(!clock_divider) return qos_quantum;
+
+    // A byte takes two psram clocks, a quarter is left for headers, gaps between bursts and cpu time.
+    uint32_t bytes_per_us = SYS_CLK_HZ / clock_divider / 2u * 3u / 4u / 1000000u;
+
+    uint32_t quantum = latency_us * bytes_per_us;
+    if(latency_us > PSRAM_PAGE_SIZE || quantum > PSRAM_PAGE_SIZE) quantum = PSRAM_PAGE_SIZE;
+    quantum -= quantum % MYQSPI_PSRAM_FILL_CHUNK;
+    if(quantum < MYQSPI_PSRAM_FILL_CHUNK) quantum = MYQSPI_PSRAM_FILL_CHUNK;
+
+    qos_quantum = quantum;
+    return quantum;
+}
+
+// Drops the lock so interrupts on this core run, and waits until a small access queued on
+// the other core got it. The spinlock isn't fair, taking it right back would starve that core.
+uint32_t MyQSPI_PSRAM::qos_handover(uint32_t intr_state){
+    uint32_t served = qos_served;
+    uint32_t other_core = get_core_num() ^ 1u;
+
+    unlock(intr_state);
+    while(qos_waiting[other_core]) tight_loop_contents();
+    intr_state = lock();
+
+    if(qos_served != served) ++qos_preemptions;
+    return intr_state;
+}
+#endif // MYQSPI_PSRAM_USE_QOS
+
+void MyQSPI_PSRAM::start_chain(const uint8_t* header, const uint8_t* payload, uint32_t payload_len){
+    dma_channel_set_read_addr(dma_chan_write, payload, false);
+    dma_channel_set_trans_count(dma_chan_write, payload_len, false);
+
+    // The payload channel is only started by the chain, so its raw completion flag
+    // is what tells the whole chunk has been handed to the pio.
+    dma_hw->intr = 1u << dma_chan_write;
+    dma_channel_transfer_from_buffer_now(dma_chan_header, header, 6);
+    chain_pending = true;
+}
+
+void MyQSPI_PSRAM::wait_for_chain(){
+    if(!chain_pending) return;
+
+    while(!(dma_hw->intr & (1u << dma_chan_write))) tight_loop_contents();
+    chain_pending = false;
+}
+
+void MyQSPI_PSRAM::fill(uint32_t& intr_state, uint32_t addr, uint32_t val, uint8_t val_size, uint32_t size){
+    if(!size) return;
+
+#ifdef MYQSPI_PSRAM_USE_QOS
+    // Batches are counted before they're sent.
+    uint32_t chunk_len;
+    uint32_t chunks = fill_batch_chunks(addr, size, chunk_len);
+    if(qos_due(chunks * chunk_len)) intr_state = qos_handover(intr_state);
+#else
+    (void)intr_state;
+#endif
+    fill_start(addr, val, val_size, size);
+    fill_next_batch();
+
+    // Same batches the interrupt would run, polled so it also works with the spinlock held.
+    while(fill_active){
+        while(!(dma_hw->intr & (1u << dma_chan_header))) tight_loop_contents();
+        dma_hw->intr = 1u << dma_chan_header;
+#ifdef MYQSPI_PSRAM_USE_QOS
+        // Between batches nothing is in flight. The fill is parked, since whoever takes the lock
+        // may use the write channel or start a fill of its own, and restarted from where it stopped.
+        if(fill_remaining){
+            chunks = fill_batch_chunks(fill_addr, fill_remaining, chunk_len);
+            if(qos_due(chunks * chunk_len)){
+                addr = fill_addr;
+                size = fill_remaining;
+                uint8_t phase = fill_phase();
+                fill_park();
+
+                intr_state = qos_handover(intr_state);
+
+                fill_start(addr, val, val_size, size, phase);
+            }
+        }
 #endif
+        fill_next_batch();
+    }
+}
+
+void MyQSPI_PSRAM::fill_start(uint32_t addr, uint32_t val, uint8_t val_size, uint32_t size, uint8_t phase){
+    fill_value = val;
+    fill_val_size = val_size;
+    fill_base = addr - phase;
+    fill_addr = addr;
+    fill_remaining = size;
+    fill_active = true;
+
+    // Payload comes from the single fill word, multi byte patterns wrap around it with a read ring.
+    dma_channel_config fill_config = dma_write_config;
+    channel_config_set_read_increment(&fill_config, val_size > 1);
+    if(val_size > 1) channel_config_set_ring(&fill_config, false, val_size == 2 ? 1 : 2);
+    channel_config_set_chain_to(&fill_config, dma_chan_control);
+
+    dma_channel_set_config(dma_chan_write, &fill_config, false);
+    // A restarted fill picks up the pattern at the byte it stopped at.
+    dma_channel_set_read_addr(dma_chan_write, reinterpret_cast<uint8_t*>(&fill_value) + phase, false);
+
+    dma_hw->intr = 1u << dma_chan_header;
+}
+
+void MyQSPI_PSRAM::fill_next_batch(){
+    if(!fill_remaining){
+        dma_irqn_set_channel_enabled(MYQSPI_PSRAM_FILL_IRQ, dma_chan_header, false);
+        dma_channel_set_config(dma_chan_write, &dma_write_config, false);
+        fill_active = false;
+        return;
+    }
+
+    uint32_t chunk_len;
+    uint32_t chunks = fill_batch_chunks(fill_addr, fill_remaining, chunk_len);
+
+    for(uint32_t i = 0; i < chunks; ++i){
+        uint8_t* header = fill_headers[i];
+
+        header[0] = 4u*2u+chunk_len*2u-1u;
+        header[1] = 0u;
+
+        header[2] = 0x38u;
+
+        header[3] = (fill_addr >> 16) & 0xFFu;
+        header[4] = (fill_addr >> 8) & 0xFFu;
+        header[5] = (fill_addr) & 0xFFu;
+
+        fill_blocks[i][0] = 6u;
+        fill_blocks[i][1] = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(header));
+
+        fill_addr += chunk_len;
+    }
+    // Null trigger on the header channel ends the batch and raises its interrupt.
+    fill_blocks[chunks][0] = 0u;
+    fill_blocks[chunks][1] = 0u;
+
+    fill_remaining -= chunks * chunk_len;
+
+    dma_channel_set_trans_count(dma_chan_write, chunk_len, false);
+    dma_channel_set_read_addr(dma_chan_control, fill_blocks, false);
+    dma_channel_set_trans_count(dma_chan_control, 2, true);
+}
+
+// Chunks are aligned to MYQSPI_PSRAM_FILL_CHUNK so they never cross a page, only the
+// first and last chunk can be shorter. The payload count is per batch, so those go alone.
+uint32_t MyQSPI_PSRAM::fill_batch_chunks(uint32_t addr, uint32_t remaining, uint32_t& chunk_len){
+    chunk_len = MYQSPI_PSRAM_FILL_CHUNK - addr % MYQSPI_PSRAM_FILL_CHUNK;
+    if(chunk_len > remaining) chunk_len = remaining;
+
+    uint32_t chunks = 1;
+    if(chunk_len == MYQSPI_PSRAM_FILL_CHUNK){
+        chunks = remaining / MYQSPI_PSRAM_FILL_CHUNK;
+        if(chunks > MYQSPI_PSRAM_FILL_BATCH) chunks = MYQSPI_PSRAM_FILL_BATCH;
+#ifdef MYQSPI_PSRAM_USE_QOS
+        if(chunks > qos_quantum / MYQSPI_PSRAM_FILL_CHUNK) chunks = qos_quantum / MYQSPI_PSRAM_FILL_CHUNK;
+#endif
+    }
+    return chunks;
+}
+
+void MyQSPI_PSRAM::fill_irq_handler(){
+    for(uint32_t i = 0; i < NUM_DMA_CHANNELS; ++i){
+        MyQSPI_PSRAM* psram = fill_owner[i];
+        if(!psram || !dma_irqn_get_channel_status(MYQSPI_PSRAM_FILL_IRQ, i)) continue;
+
+        dma_irqn_acknowledge_channel(MYQSPI_PSRAM_FILL_IRQ, i);
+#ifdef MYQSPI_PSRAM_USE_QOS
+        // Small accesses waiting for the bus go first, the last of them restarts the fill from unlock().
+        // Parking takes the lock, so the other core can't restart the fill before it's fully parked.
+        // Parked is set before active is cleared, so pmemset_busy() never sees an idle engine.
+        if(psram->fill_remaining && psram->qos_contended()){
+            uint32_t intr_state = spin_lock_blocking(psram->psram_spinlock);
+            dma_irqn_set_channel_enabled(MYQSPI_PSRAM_FILL_IRQ, i, false);
+            psram->fill_parked = true;
+            psram->fill_park();
+            spin_unlock(psram->psram_spinlock, intr_state);
+            continue;
+        }
+#endif
+        psram->fill_next_batch();
+    }
+}
+
+// Between batches, puts the write channel back for normal transfers and frees the bus.
+void MyQSPI_PSRAM::fill_park(){
+    dma_channel_set_config(dma_chan_write, &dma_write_config, false);
+    fill_active = false;
+}
+
+// Restarts a fill parked by the interrupt where it stopped, called with the lock held.
+// Active is set before parked is cleared, so pmemset_busy() never sees an idle engine.
+void MyQSPI_PSRAM::fill_resume(){
+    fill_start(fill_addr, fill_value, fill_val_size, fill_remaining, fill_phase());
+    fill_parked = false;
+    dma_irqn_set_channel_enabled(MYQSPI_PSRAM_FILL_IRQ, dma_chan_header, true);
+    fill_next_batch();
+}
+
+/// @brief Test the data path of the whole psram. Destroys the psram contents and uses the DMA sniffer.
+/// @param report Filled with the failing addresses and burst lengths.
+/// @param block Scratch buffer of PSRAM_PAGE_SIZE bytes, 4 byte aligned. Pass a static buffer, it's too big for the stack.
+/// @param tests MyQSPI_TESTS bits of the tests to run.
+MyQSPI_ERRORS MyQSPI_PSRAM::self_test(MyQSPI_TestReport& report, uint8_t* block, uint8_t tests){
+    memset(&report, 0, sizeof(report));
+    uint32_t start = time_us_32();
+
+    if(tests & MYQSPI_TEST_WALKING_ONES) test_walking_ones(report);
+    if(tests & MYQSPI_TEST_ADDRESS) test_address(report, block);
+    if(tests & MYQSPI_TEST_BURSTS) test_bursts(report, block);
+    if(tests & MYQSPI_TEST_MARCH_C) test_march(report, block);
+
+    report.time_us = time_us_32() - start;
+
+    return report.errors ? MyQSPI_ERRORS::PSRAM_ERROR_SELF_TEST_FAILED : MyQSPI_ERRORS::PSRAM_OK;
+}
+
+void MyQSPI_PSRAM::test_walking_ones(MyQSPI_TestReport& report){
+    // Data lines, every bit on its own.
+    for(uint32_t bit = 0; bit < 32; ++bit){
+        write32(0, 1u << bit);
+        flush();
+        uint32_t actual = read32(0);
+        for(uint32_t i = 0; i < 4; ++i){
+            uint8_t expected_byte = ((1u << bit) >> (i*8)) & 0xFFu;
+            uint8_t actual_byte = (actual >> (i*8)) & 0xFFu;
+            if(expected_byte != actual_byte) test_fail(report, i, expected_byte, actual_byte, MYQSPI_TEST_WALKING_ONES, 0);
+        }
+    }
+
+    // Address lines, a shorted or stuck line makes two of these alias.
+    write8(0, 0xFFu);
+    for(uint32_t line = 0; (1u << line) < psram_size; ++line) write8(1u << line, line);
+    flush();
+
+    uint8_t actual = read8(0);
+    if(actual != 0xFFu) test_fail(report, 0, 0xFFu, actual, MYQSPI_TEST_WALKING_ONES, 0);
+    for(uint32_t line = 0; (1u << line) < psram_size; ++line){
+        actual = read8(1u << line);
+        if(actual != line) test_fail(report, 1u << line, line, actual, MYQSPI_TEST_WALKING_ONES, 0);
+    }
+}
+
+void MyQSPI_PSRAM::test_address(MyQSPI_TestReport& report, uint8_t* block){
+    uint32_t* words = reinterpret_cast<uint32_t*>(block);
+
+    for(uint32_t addr = 0; addr < psram_size; addr += PSRAM_PAGE_SIZE){
+        for(uint32_t i = 0; i < PSRAM_PAGE_SIZE / 4u; ++i) words[i] = addr + i*4u;
+        write(addr, block, PSRAM_PAGE_SIZE);
+    }
+
+    for(uint32_t addr = 0; addr < psram_size; addr += PSRAM_PAGE_SIZE){
+        read(addr, block, PSRAM_PAGE_SIZE);
+        for(uint32_t i = 0; i < PSRAM_PAGE_SIZE / 4u; ++i){
+            uint32_t expected = addr + i*4u;
+            if(words[i] == expected) continue;
+
+            for(uint32_t b = 0; b < 4; ++b){
+                uint8_t expected_byte = (expected >> (b*8)) & 0xFFu;
+                if(block[i*4u+b] != expected_byte) test_fail(report, expected + b, expected_byte, block[i*4u+b], MYQSPI_TEST_ADDRESS, 0);
+            }
+        }
+    }
+}
+
+void MyQSPI_PSRAM::test_bursts(MyQSPI_TestReport& report, uint8_t* block){
+    uint8_t* expected = block;
+    uint8_t* actual = block + 128;
+    uint32_t pages = psram_size / PSRAM_PAGE_SIZE < 16u ? psram_size / PSRAM_PAGE_SIZE : 16u;
+    uint32_t seed = 0x12345678u;
+
+    for(uint32_t n = 0; n < sizeof(test_burst_lengths); ++n){
+        uint32_t burst_len = test_burst_lengths[n];
+
+        // In the middle of the page, every length up to 124 bytes goes out as a single burst.
+        for(uint32_t page = 1; page < pages; ++page){
+            uint32_t addr = page * PSRAM_PAGE_SIZE + PSRAM_PAGE_SIZE / 2u;
+
+            for(uint32_t i = 0; i < burst_len; ++i){
+                seed = seed * 1664525u + 1013904223u;
+                expected[i] = seed >> 24;
+            }
+
+            write(addr, expected, burst_len);
+            read(addr, actual, burst_len);
+
+            for(uint32_t i = 0; i < burst_len; ++i){
+                if(actual[i] == expected[i]) continue;
+
+                report.burst_fail_mask |= 1u << n;
+                test_fail(report, addr + i, expected[i], actual[i], MYQSPI_TEST_BURSTS, burst_len);
+            }
+        }
+    }
+}
+
+void MyQSPI_PSRAM::test_march(MyQSPI_TestReport& report, uint8_t* block){
+    // March C- with page sized blocks: up(w0) up(r0,w1) up(r1,w0) down(r0,w1) down(r1,w0) up(r0)
+    static const struct { bool up; uint8_t read; uint8_t write; } elements[] = {
+        {true, 0x00u, 0xFFu},
+        {true, 0xFFu, 0x00u},
+        {false, 0x00u, 0xFFu},
+        {false, 0xFFu, 0x00u},
+    };
+    uint32_t pages = psram_size / PSRAM_PAGE_SIZE;
+
+    pmemset(0, 0x00u, psram_size);
+
+    dma_sniffer_enable(dma_chan_read, DMA_SNIFF_CTRL_CALC_VALUE_SUM, true);
+
+    for(const auto& element : elements){
+        for(uint32_t n = 0; n < pages; ++n){
+            uint32_t addr = (element.up ? n : pages - 1u - n) * PSRAM_PAGE_SIZE;
+            test_block(report, addr, block, element.read, MYQSPI_TEST_MARCH_C);
+            pmemset(addr, element.write, PSRAM_PAGE_SIZE);
+        }
+    }
+
+    for(uint32_t addr = 0; addr < psram_size; addr += PSRAM_PAGE_SIZE){
+        test_block(report, addr, block, 0x00u, MYQSPI_TEST_MARCH_C);
+    }
+
+    dma_sniffer_disable();
+}
+
+bool MyQSPI_PSRAM::test_block(MyQSPI_TestReport& report, uint32_t addr, uint8_t* block, uint8_t expected, uint8_t test){
+    // The sniffer sums the bytes as they arrive, for a constant pattern any flipped bit moves the sum
+    // the same way, so the cpu only looks at the block when something is wrong.
+    dma_sniffer_set_data_accumulator(0);
+    read(addr, block, PSRAM_PAGE_SIZE);
+    if(dma_sniffer_get_data_accumulator() == expected * PSRAM_PAGE_SIZE) return true;
+
+    for(uint32_t i = 0; i < PSRAM_PAGE_SIZE; ++i){
+        if(block[i] != expected) test_fail(report, addr + i, expected, block[i], test, 0);
+    }
+    return false;
+}
+
+void MyQSPI_PSRAM::test_fail(MyQSPI_TestReport& report, uint32_t addr, uint8_t expected, uint8_t actual, uint8_t test, uint8_t burst_len){
+    ++report.errors;
+    if(report.fail_count < MYQSPI_PSRAM_TEST_MAX_FAILS){
+        report.fails[report.fail_count++] = {addr, expected, actual, test, burst_len};
+    }
+}
+
+void MyQSPI_PSRAM::setup_pins(){
+    pio_gpio_init(_pio, cs_sck_pins);
+    pio_gpio_init(_pio, cs_sck_pins + 1);
+    pio_gpio_init(_pio, data_pins);
+    pio_gpio_init(_pio, data_pins + 1);
+    pio_gpio_init(_pio, data_pins + 2);
+    pio_gpio_init(_pio, data_pins + 3);
+
+    gpio_set_slew_rate(cs_sck_pins, GPIO_SLEW_RATE_FAST);
+    gpio_set_slew_rate(cs_sck_pins + 1, GPIO_SLEW_RATE_FAST);    
+    gpio_set_slew_rate(data_pins, GPIO_SLEW_RATE_FAST);
+    gpio_set_slew_rate(data_pins + 1, GPIO_SLEW_RATE_FAST);
+    gpio_set_slew_rate(data_pins + 2, GPIO_SLEW_RATE_FAST);
+    gpio_set_slew_rate(data_pins + 3, GPIO_SLEW_RATE_FAST);
+
+    gpio_set_drive_strength(cs_sck_pins, GPIO_DRIVE_STRENGTH_12MA);
+    gpio_set_drive_strength(cs_sck_pins + 1, GPIO_DRIVE_STRENGTH_12MA);    
+    gpio_set_drive_strength(data_pins, GPIO_DRIVE_STRENGTH_12MA);
+    gpio_set_drive_strength(data_pins + 1, GPIO_DRIVE_STRENGTH_12MA);
+    gpio_set_drive_strength(data_pins + 2, GPIO_DRIVE_STRENGTH_12MA);
+    gpio_set_drive_strength(data_pins + 3, GPIO_DRIVE_STRENGTH_12MA);
+
+    gpio_set_input_hysteresis_enabled(cs_sck_pins, false);
+    gpio_set_input_hysteresis_enabled(cs_sck_pins + 1, false);    
+    gpio_set_input_hysteresis_enabled(data_pins, false);
+    gpio_set_input_hysteresis_enabled(data_pins + 1, false);
+    gpio_set_input_hysteresis_enabled(data_pins + 2, false);
+    gpio_set_input_hysteresis_enabled(data_pins + 3, false);
+
+    hw_set_bits(&_pio->input_sync_bypass, 0xfu << data_pins);
+}
+
+// Sends 0xF5 in quad mode with plain gpio, so the chip leaves quad mode without loading the qspi program just for that.
+// A chip in spi mode only sees two clocks and ignores it.
+void MyQSPI_PSRAM::exit_quad_mode(){
+    uint32_t data_mask = 0xFu << data_pins;
+    uint32_t mask = data_mask | (1u << cs_sck_pins) | (1u << (cs_sck_pins + 1));
+
+    gpio_init_mask(mask);
+    gpio_put(cs_sck_pins, true);
+    gpio_put(cs_sck_pins + 1, false);
+    gpio_set_dir_out_masked(mask);
+
+    gpio_put(cs_sck_pins, false);
+    for(uint32_t nibble : {0xFu, 0x5u}){
+        gpio_put_masked(data_mask, nibble << data_pins);
+        busy_wait_us(1);
+        gpio_put(cs_sck_pins + 1, true);
+        busy_wait_us(1);
+        gpio_put(cs_sck_pins + 1, false);
+    }
+    busy_wait_us(1);
+    gpio_put(cs_sck_pins, true);
+
+    gpio_set_dir_in_masked(data_mask);
+}
+
+// Resets the chip and reads its size with the spi program, then leaves it in quad mode.
+MyQSPI_ERRORS MyQSPI_PSRAM::detect(){
+    uint spi_offset = pio_add_program(_pio, &spi_rw_program);
+
+    uint spi_sm = pio_claim_unused_sm(_pio, true);
+    pio_sm_config spi_sm_config = pio_get_default_sm_config();
+
+    sm_config_set_wrap(&spi_sm_config, spi_offset + spi_rw_wrap_target, spi_offset + spi_rw_wrap);
+    sm_config_set_sideset(&spi_sm_config, 2, false, false);
+
+    sm_config_set_sideset_pins(&spi_sm_config, cs_sck_pins);
+    sm_config_set_out_pins(&spi_sm_config, data_pins, 1);
+    sm_config_set_in_pins(&spi_sm_config, data_pins+1);
+
+    sm_config_set_clkdiv(&spi_sm_config, 2);
+
+    sm_config_set_out_shift(&spi_sm_config, false, true, 8);
+    sm_config_set_in_shift(&spi_sm_config, false, true, 8);
+
+    pio_sm_set_consecutive_pindirs(_pio, spi_sm, cs_sck_pins, 2, true);
+    pio_sm_set_consecutive_pindirs(_pio, spi_sm, data_pins, 1, true);
+    pio_sm_set_consecutive_pindirs(_pio, spi_sm, data_pins+1, 1, false);
+
+    if(pio_sm_init(_pio, spi_sm, spi_offset, &spi_sm_config) != PICO_OK){
+        pio_remove_program_and_unclaim_sm(&spi_rw_program, _pio, spi_sm, spi_offset);
+        return MyQSPI_ERRORS::PIO_ERROR_COULD_NOT_INITIALIZE;
+    }
+    pio_sm_set_enabled(_pio, spi_sm, true);
+
+    pio_sm_put_blocking(_pio, spi_sm, 0x08000000u);
+    pio_sm_put_blocking(_pio, spi_sm, 0x00000000u);
+    pio_sm_put_blocking(_pio, spi_sm, 0x66000000u);
+
+    busy_wait_us(10);
+
+    pio_sm_put_blocking(_pio, spi_sm, 0x08000000u);
+    pio_sm_put_blocking(_pio, spi_sm, 0x00000000u);
+    pio_sm_put_blocking(_pio, spi_sm, 0x99000000u);
+
+    busy_wait_us(150);
+
+    uint32_t kgd = 0, eid = 0;
+    pio_sm_put_blocking(_pio, spi_sm, 0x20000000u);
+    pio_sm_put_blocking(_pio, spi_sm, 0x30000000u);
+
+    pio_sm_put_blocking(_pio, spi_sm, 0x9F000000u);
+    for(int i = 0; i < 3; ++i) pio_sm_put_blocking(_pio, spi_sm, 0xFF000000u);
+
+    pio_sm_get_blocking(_pio, spi_sm);
+    kgd = pio_sm_get_blocking(_pio, spi_sm);
+    eid = pio_sm_get_blocking(_pio, spi_sm);
+    pio_sm_get_blocking(_pio, spi_sm);
+    pio_sm_get_blocking(_pio, spi_sm);
+    pio_sm_get_blocking(_pio, spi_sm);
+
+    if(kgd != 0x5D){
+        pio_sm_set_enabled(_pio, spi_sm, false);
+        pio_remove_program_and_unclaim_sm(&spi_rw_program, _pio, spi_sm, spi_offset);
+        return MyQSPI_ERRORS::PSRAM_ERROR_COULD_NOT_DETECT_PSRAM;
+    }
+
+    psram_size = 1024 * 1024;
+    uint8_t size_id = eid >> 5;
+    if (eid == 0x26 || size_id == 2) {
+        psram_size *= 8;
+    } else if (size_id == 0) {
+        psram_size *= 2;
+    } else if (size_id == 1) {
+        psram_size *= 4;
+    }
+
+    busy_wait_us(2);
+
+    pio_sm_put_blocking(_pio, spi_sm, 0x08000000u);
+    pio_sm_put_blocking(_pio, spi_sm, 0x00000000u);
+    
+    pio_sm_put_blocking(_pio, spi_sm, 0x35000000u);
+
+    busy_wait_us(10);
+    
+    pio_sm_set_enabled(_pio, spi_sm, false);
+    pio_remove_program_and_unclaim_sm(&spi_rw_program, _pio, spi_sm, spi_offset);
+
+    detected = true;
+
+    return MyQSPI_ERRORS::PSRAM_OK;
+}
+
+int MyQSPI_PSRAM::start_qspi_sm(){
+    pio_sm_set_enabled(_pio, qspi_sm, false);
+
+    pio_sm_set_consecutive_pindirs(_pio, qspi_sm, cs_sck_pins, 2, true);
+    pio_sm_set_consecutive_pindirs(_pio, qspi_sm, data_pins, 4, false);
+
+    int result = pio_sm_init(_pio, qspi_sm, qspi_offset, &qspi_sm_config);
+    if(result != PICO_OK) return result;
+
+    pio_sm_set_enabled(_pio, qspi_sm, true);
+    return PICO_OK;
+}
+
+void MyQSPI_PSRAM::setup_dma(){
+    bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_DMA_R_BITS | BUSCTRL_BUS_PRIORITY_DMA_W_BITS;
+
+    dma_write_config = dma_channel_get_default_config(dma_chan_write);
+
+    channel_config_set_transfer_data_size(&dma_write_config, DMA_SIZE_8);      
+
+    channel_config_set_read_increment(&dma_write_config, true);                        
+    channel_config_set_write_increment(&dma_write_config, false);    
+
+    channel_config_set_high_priority(&dma_write_config, true);     
+
+    channel_config_set_dreq(&dma_write_config, pio_get_dreq(_pio, qspi_sm, true));    
+    
+    dma_channel_set_config(dma_chan_write, &dma_write_config, false);
+    dma_channel_set_write_addr(dma_chan_write, &_pio->txf[qspi_sm], false);
+
+    dma_read_config = dma_channel_get_default_config(dma_chan_read);
+
+    channel_config_set_transfer_data_size(&dma_read_config, DMA_SIZE_8);     
+
+    channel_config_set_read_increment(&dma_read_config, false);  
+    channel_config_set_write_increment(&dma_read_config, true);   
+
+    channel_config_set_high_priority(&dma_read_config, true);
+
+    channel_config_set_dreq(&dma_read_config, pio_get_dreq(_pio, qspi_sm, false));  
+    
+    dma_channel_set_config(dma_chan_read, &dma_read_config, false);
+    dma_channel_set_read_addr(dma_chan_read, &_pio->rxf[qspi_sm], false);
+
+    dma_channel_config dma_header_config = dma_write_config;
+
+    channel_config_set_chain_to(&dma_header_config, dma_chan_write);
+    channel_config_set_irq_quiet(&dma_header_config, true);
+
+    dma_channel_set_config(dma_chan_header, &dma_header_config, false);
+    dma_channel_set_write_addr(dma_chan_header, &_pio->txf[qspi_sm], false);
+
+    dma_channel_config dma_control_config = dma_channel_get_default_config(dma_chan_control);
+
+    channel_config_set_transfer_data_size(&dma_control_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&dma_control_config, true);
+    channel_config_set_write_increment(&dma_control_config, true);
+    channel_config_set_ring(&dma_control_config, true, 3);
+
+    dma_channel_set_config(dma_chan_control, &dma_control_config, false);
+    dma_channel_set_write_addr(dma_chan_control, &dma_hw->ch[dma_chan_header].al3_transfer_count, false);
+}
+
+// Reset and quad mode entry through the qspi program, so the spi program doesn't have to be loaded again.
+// In spi mode the chip only samples SIO0, SIO2 and SIO3 are held high.
+void MyQSPI_PSRAM::reset_to_quad_mode(){
+    // Same psram clock as detect() uses, SYS_CLK_HZ/4, the commands don't need to run at full speed.
+    pio_sm_set_clkdiv(_pio, qspi_sm, 4.0f / clock_divider);
+
+    send_quad_command(0xF5u);
+    send_spi_command(0x66u);
+    send_spi_command(0x99u);
+
+    busy_wait_us(150);
+
+    send_spi_command(0x35u);
+
+    busy_wait_us(10);
+
+    pio_sm_set_clkdiv(_pio, qspi_sm, 1.0f);
+}
+
+void MyQSPI_PSRAM::send_quad_command(uint8_t cmd){
+    pio_sm_put_blocking(_pio, qspi_sm, (2u-1u) << 24);
+    pio_sm_put_blocking(_pio, qspi_sm, 0x00000000u);
+    pio_sm_put_blocking(_pio, qspi_sm, static_cast<uint32_t>(cmd) << 24);
+
+    while(!pio_sm_is_tx_fifo_empty(_pio, qspi_sm)) tight_loop_contents();
+    busy_wait_us(1);
+}
+
+void MyQSPI_PSRAM::send_spi_command(uint8_t cmd){
+    pio_sm_put_blocking(_pio, qspi_sm, (8u-1u) << 24);
+    pio_sm_put_blocking(_pio, qspi_sm, 0x00000000u);
+    for(int bit = 7; bit > 0; bit -= 2){
+        uint32_t high = 0xCu | ((cmd >> bit) & 1u);
+        uint32_t low = 0xCu | ((cmd >> (bit - 1)) & 1u);
+        pio_sm_put_blocking(_pio, qspi_sm, ((high << 4) | low) << 24);
+    }
+
+    while(!pio_sm_is_tx_fifo_empty(_pio, qspi_sm)) tight_loop_contents();
+    busy_wait_us(1);
 }
 
 uint8_t MyQSPI_PSRAM::find_clock_divisor()
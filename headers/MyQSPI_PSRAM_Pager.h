@@ -0,0 +1,113 @@
+#ifndef MY_QSPI_PSRAM_PAGER_H
+#define MY_QSPI_PSRAM_PAGER_H
+
+#include "MyQSPI_PSRAM.h"
+
+#ifndef MYQSPI_PSRAM_PAGER_FRAMES
+    #define MYQSPI_PSRAM_PAGER_FRAMES 8
+#endif
+
+/// @brief Demand paged view of the psram, keeps the hot pages in sram frames.
+class MyQSPI_PSRAM_Pager{
+    public:
+        /// @brief Pin handle, keeps the page resident until it goes out of scope.
+        class Handle{
+            public:
+                Handle(MyQSPI_PSRAM_Pager& pager, uint32_t addr, bool dirty);
+                Handle(Handle&& other);
+                Handle(const Handle&) = delete;
+                Handle& operator=(const Handle&) = delete;
+                ~Handle();
+
+                /// @brief Pointer to the byte at the pinned address, nullptr if no frame could be freed.
+                uint8_t* data(){ return ptr; };
+
+                /// @brief Mark the pinned page as modified.
+                void mark_dirty();
+
+            private:
+                MyQSPI_PSRAM_Pager* pager;
+                uint32_t addr;
+                uint8_t* ptr;
+        };
+
+        /// @brief Create a pager on top of an already initialized psram.
+        /// @param psram Psram to page in from.
+        MyQSPI_PSRAM_Pager(MyQSPI_PSRAM& psram);
+
+        /// @brief Make the page holding addr resident and pin it.
+        /// @param addr Psram address.
+        /// @param dirty Mark the page as modified.
+        /// @return Pointer to the byte at addr inside the frame, valid up to the end of the page. nullptr if every frame is pinned.
+        uint8_t* MYQSPI_PSRAM_FUNC_WRAPPER(pin)(uint32_t addr, bool dirty=false);
+
+        /// @brief Release a pin taken with pin().
+        /// @param addr Any address inside the pinned page.
+        void MYQSPI_PSRAM_FUNC_WRAPPER(unpin)(uint32_t addr);
+
+        /// @brief Pin a page and get a handle that unpins it automatically.
+        /// @param addr Psram address.
+        /// @param dirty Mark the page as modified.
+        Handle acquire(uint32_t addr, bool dirty=false){ return Handle(*this, addr, dirty); };
+
+        /// @brief Mark a resident page as modified.
+        /// @param addr Any address inside the page.
+        void mark_dirty(uint32_t addr);
+
+        /// @brief Read a value through the page frames. A value crossing a page boundary is read from the psram directly.
+        /// @param addr Psram address.
+        template<typename T> T get(uint32_t addr);
+
+        /// @brief Write a value through the page frames. A value crossing a page boundary is written to the psram directly.
+        /// @param addr Psram address.
+        /// @param data Data.
+        template<typename T> void set(uint32_t addr, T data);
+
+        /// @brief Write every dirty frame back to the psram.
+        void MYQSPI_PSRAM_FUNC_WRAPPER(flush)();
+
+        /// @brief Write back every dirty frame and drop all unpinned frames.
+        void invalidate();
+
+        /// @brief Load the next page as well when pages are faulted in sequentially.
+        void set_prefetch(bool enable){ prefetch = enable; };
+
+        /// @brief Number of accesses served from a frame.
+        uint32_t get_hits(){ return hits; };
+
+        /// @brief Number of accesses that had to load a page from the psram.
+        uint32_t get_misses(){ return misses; };
+
+    private: // private Variables
+        struct Frame{
+            uint32_t page;
+            uint16_t pins;
+            bool valid;
+            bool dirty;
+            bool referenced;
+        };
+
+        MyQSPI_PSRAM& psram;
+
+        alignas(4) uint8_t frame_data[MYQSPI_PSRAM_PAGER_FRAMES][PSRAM_PAGE_SIZE];
+        Frame frames[MYQSPI_PSRAM_PAGER_FRAMES];
+
+        uint32_t clock_hand;
+        uint32_t last_frame;
+        uint32_t last_miss_page;
+        bool prefetch;
+
+        uint32_t hits, misses;
+
+    private: // private Functions
+        int32_t find_frame(uint32_t page);
+        int32_t load_page(uint32_t page);
+        int32_t evict_frame();
+        void write_back(uint32_t frame);
+        void write_back_span(uint32_t addr, uint32_t len);
+        void update_span(uint32_t addr, const uint8_t* data, uint32_t len);
+};
+
+#include "MyQSPI_PSRAM_Pager.hpp"
+
+#endif // MY_QSPI_PSRAM_PAGER_H
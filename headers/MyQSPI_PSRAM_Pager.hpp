@@ -0,0 +1,223 @@
+#ifndef MY_QSPI_PSRAM_PAGER_IMPL_H
+#define MY_QSPI_PSRAM_PAGER_IMPL_H
+
+#include "MyQSPI_PSRAM_Pager.h"
+
+MyQSPI_PSRAM_Pager::Handle::Handle(MyQSPI_PSRAM_Pager& pager, uint32_t addr, bool dirty)
+:
+pager(&pager),
+addr(addr)
+{
+    ptr = pager.pin(addr, dirty);
+}
+
+MyQSPI_PSRAM_Pager::Handle::Handle(Handle&& other)
+:
+pager(other.pager),
+addr(other.addr),
+ptr(other.ptr)
+{
+    other.ptr = nullptr;
+}
+
+MyQSPI_PSRAM_Pager::Handle::~Handle()
+{
+    if(ptr) pager->unpin(addr);
+}
+
+void MyQSPI_PSRAM_Pager::Handle::mark_dirty()
+{
+    if(ptr) pager->mark_dirty(addr);
+}
+
+/// @brief Create a pager on top of an already initialized psram.
+/// @param psram Psram to page in from.
+MyQSPI_PSRAM_Pager::MyQSPI_PSRAM_Pager(MyQSPI_PSRAM& psram)
+:
+psram(psram),
+clock_hand(0),
+last_frame(0),
+last_miss_page(0xFFFFFFFFu),
+prefetch(true),
+hits(0),
+misses(0)
+{
+    for(uint32_t i = 0; i < MYQSPI_PSRAM_PAGER_FRAMES; ++i){
+        frames[i] = {0, 0, false, false, false};
+    }
+}
+
+/// @brief Make the page holding addr resident and pin it.
+/// @param addr Psram address.
+/// @param dirty Mark the page as modified.
+/// @return Pointer to the byte at addr inside the frame. nullptr if every frame is pinned.
+uint8_t* MyQSPI_PSRAM_Pager::pin(uint32_t addr, bool dirty){
+    uint32_t page = addr / PSRAM_PAGE_SIZE;
+    int32_t frame = find_frame(page);
+
+    if(frame < 0){
+        frame = load_page(page);
+        if(frame < 0) return nullptr;
+    }else{
+        ++hits;
+    }
+
+    frames[frame].pins++;
+    frames[frame].referenced = true;
+    frames[frame].dirty |= dirty;
+    last_frame = frame;
+
+    return frame_data[frame] + (addr % PSRAM_PAGE_SIZE);
+}
+
+/// @brief Release a pin taken with pin().
+/// @param addr Any address inside the pinned page.
+void MyQSPI_PSRAM_Pager::unpin(uint32_t addr){
+    int32_t frame = find_frame(addr / PSRAM_PAGE_SIZE);
+    if(frame >= 0 && frames[frame].pins) frames[frame].pins--;
+}
+
+/// @brief Mark a resident page as modified.
+/// @param addr Any address inside the page.
+void MyQSPI_PSRAM_Pager::mark_dirty(uint32_t addr){
+    int32_t frame = find_frame(addr / PSRAM_PAGE_SIZE);
+    if(frame >= 0) frames[frame].dirty = true;
+}
+
+template<typename T>
+T MyQSPI_PSRAM_Pager::get(uint32_t addr){
+    T data;
+    // A value crossing into the next page isn't contiguous in the frames, read it from the psram.
+    if(addr % PSRAM_PAGE_SIZE + sizeof(T) > PSRAM_PAGE_SIZE){
+        write_back_span(addr, sizeof(T));
+        psram.read(addr, reinterpret_cast<uint8_t*>(&data), sizeof(T));
+        return data;
+    }
+    uint8_t* ptr = pin(addr);
+    if(!ptr){
+        psram.read(addr, reinterpret_cast<uint8_t*>(&data), sizeof(T));
+        return data;
+    }
+    memcpy(&data, ptr, sizeof(T));
+    unpin(addr);
+    return data;
+}
+
+template<typename T>
+void MyQSPI_PSRAM_Pager::set(uint32_t addr, T data){
+    if(addr % PSRAM_PAGE_SIZE + sizeof(T) > PSRAM_PAGE_SIZE){
+        psram.write(addr, reinterpret_cast<const uint8_t*>(&data), sizeof(T));
+        update_span(addr, reinterpret_cast<const uint8_t*>(&data), sizeof(T));
+        return;
+    }
+    uint8_t* ptr = pin(addr, true);
+    if(!ptr){
+        psram.write(addr, reinterpret_cast<const uint8_t*>(&data), sizeof(T));
+        return;
+    }
+    memcpy(ptr, &data, sizeof(T));
+    unpin(addr);
+}
+
+/// @brief Write every dirty frame back to the psram.
+void MyQSPI_PSRAM_Pager::flush(){
+    for(uint32_t i = 0; i < MYQSPI_PSRAM_PAGER_FRAMES; ++i){
+        if(frames[i].valid && frames[i].dirty) write_back(i);
+    }
+}
+
+/// @brief Write back every dirty frame and drop all unpinned frames.
+void MyQSPI_PSRAM_Pager::invalidate(){
+    for(uint32_t i = 0; i < MYQSPI_PSRAM_PAGER_FRAMES; ++i){
+        if(!frames[i].valid || frames[i].pins) continue;
+        if(frames[i].dirty) write_back(i);
+        frames[i].valid = false;
+        frames[i].referenced = false;
+    }
+    last_miss_page = 0xFFFFFFFFu;
+}
+
+int32_t MyQSPI_PSRAM_Pager::find_frame(uint32_t page){
+    if(frames[last_frame].valid && frames[last_frame].page == page) return last_frame;
+
+    for(uint32_t i = 0; i < MYQSPI_PSRAM_PAGER_FRAMES; ++i){
+        if(frames[i].valid && frames[i].page == page) return i;
+    }
+    return -1;
+}
+
+int32_t MyQSPI_PSRAM_Pager::load_page(uint32_t page){
+    int32_t frame = evict_frame();
+    if(frame < 0) return -1;
+
+    ++misses;
+
+    psram.read(page * PSRAM_PAGE_SIZE, frame_data[frame], PSRAM_PAGE_SIZE);
+    frames[frame] = {page, 0, true, false, true};
+
+    // Sequential faults, bring in the next page too so the scan hits a resident frame.
+    bool sequential = (page == last_miss_page + 1);
+    last_miss_page = page;
+    uint32_t next = page + 1;
+
+    if(prefetch && sequential && next * PSRAM_PAGE_SIZE < psram.get_size() && find_frame(next) < 0){
+        frames[frame].pins++;
+        int32_t ahead = evict_frame();
+        frames[frame].pins--;
+
+        if(ahead >= 0){
+            psram.read(next * PSRAM_PAGE_SIZE, frame_data[ahead], PSRAM_PAGE_SIZE);
+            frames[ahead] = {next, 0, true, false, false};
+            last_miss_page = next;
+        }
+    }
+
+    return frame;
+}
+
+int32_t MyQSPI_PSRAM_Pager::evict_frame(){
+    // CLOCK: give referenced frames a second chance, never touch pinned ones.
+    for(uint32_t i = 0; i < 2 * MYQSPI_PSRAM_PAGER_FRAMES; ++i){
+        uint32_t frame = clock_hand;
+        clock_hand = (clock_hand + 1) % MYQSPI_PSRAM_PAGER_FRAMES;
+
+        if(!frames[frame].valid) return frame;
+        if(frames[frame].pins) continue;
+        if(frames[frame].referenced){
+            frames[frame].referenced = false;
+            continue;
+        }
+
+        if(frames[frame].dirty) write_back(frame);
+        frames[frame].valid = false;
+        return frame;
+    }
+    return -1;
+}
+
+// Writes back the dirty frames holding any part of the span, so a direct psram read sees their data.
+void MyQSPI_PSRAM_Pager::write_back_span(uint32_t addr, uint32_t len){
+    for(uint32_t page = addr / PSRAM_PAGE_SIZE; page <= (addr + len - 1u) / PSRAM_PAGE_SIZE; ++page){
+        int32_t frame = find_frame(page);
+        if(frame >= 0 && frames[frame].dirty) write_back(frame);
+    }
+}
+
+// Copies data written directly to the psram into the frames holding any part of the span.
+void MyQSPI_PSRAM_Pager::update_span(uint32_t addr, const uint8_t* data, uint32_t len){
+    for(uint32_t page = addr / PSRAM_PAGE_SIZE; page <= (addr + len - 1u) / PSRAM_PAGE_SIZE; ++page){
+        int32_t frame = find_frame(page);
+        if(frame < 0) continue;
+
+        uint32_t start = page * PSRAM_PAGE_SIZE > addr ? page * PSRAM_PAGE_SIZE : addr;
+        uint32_t end = (page + 1u) * PSRAM_PAGE_SIZE < addr + len ? (page + 1u) * PSRAM_PAGE_SIZE : addr + len;
+        memcpy(frame_data[frame] + start % PSRAM_PAGE_SIZE, data + (start - addr), end - start);
+    }
+}
+
+void MyQSPI_PSRAM_Pager::write_back(uint32_t frame){
+    psram.write(frames[frame].page * PSRAM_PAGE_SIZE, frame_data[frame], PSRAM_PAGE_SIZE);
+    frames[frame].dirty = false;
+}
+
+#endif // MY_QSPI_PSRAM_PAGER_IMPL_H
@@ -0,0 +1,93 @@
+#ifndef MY_QSPI_PSRAM_STORE_H
+#define MY_QSPI_PSRAM_STORE_H
+
+#include <algorithm>
+
+#include "MyQSPI_PSRAM.h"
+
+#ifndef MYQSPI_PSRAM_STORE_SLOTS
+    #define MYQSPI_PSRAM_STORE_SLOTS 512u
+#endif
+
+static_assert((MYQSPI_PSRAM_STORE_SLOTS & (MYQSPI_PSRAM_STORE_SLOTS - 1u)) == 0, "MYQSPI_PSRAM_STORE_SLOTS must be a power of two");
+static_assert(MYQSPI_PSRAM_STORE_SLOTS <= 65536u, "MYQSPI_PSRAM_STORE_SLOTS must fit in 16 bits");
+
+/// @brief Key/value store kept as an append log in psram, with an open addressing index in sram.
+class MyQSPI_PSRAM_Store{
+    public:
+        /// @brief Largest value that fits in one record, records never cross a page.
+        static constexpr uint32_t MAX_VALUE_LEN = PSRAM_PAGE_SIZE - 8u;
+
+        /// @brief Create a store in a region of an already initialized psram.
+        /// @param psram Psram holding the log.
+        /// @param base First byte of the region, rounded up to a page boundary.
+        /// @param size Size of the region. Half of it holds the log, the other half is the compaction target.
+        MyQSPI_PSRAM_Store(MyQSPI_PSRAM& psram, uint32_t base, uint32_t size);
+
+        /// @brief Insert or replace a value. Header and value go out together, in a single burst for values up to 116 bytes.
+        /// @param key Key.
+        /// @param data Value.
+        /// @param len Length of the value, MAX_VALUE_LEN at most.
+        /// @return false if the value is too long, the index is full or the log is full even after compaction.
+        bool MYQSPI_PSRAM_FUNC_WRAPPER(put)(uint32_t key, const uint8_t* data, uint32_t len);
+
+        /// @brief Read a value, in a single burst for values up to 128 bytes.
+        /// @param key Key.
+        /// @param data Read buffer.
+        /// @param max_len Size of the read buffer, longer values are truncated.
+        /// @return Length of the stored value, -1 if the key is not present.
+        int32_t MYQSPI_PSRAM_FUNC_WRAPPER(get)(uint32_t key, uint8_t* data, uint32_t max_len);
+
+        /// @brief Check if a key is present, doesn't touch the psram.
+        bool contains(uint32_t key){ return find_slot(key) >= 0; };
+
+        /// @brief Remove a key, the space is reclaimed by the next compaction.
+        /// @return false if the key was not present.
+        bool erase(uint32_t key);
+
+        /// @brief Copy the live records into the other half of the region with pmemcpy and switch to it.
+        void MYQSPI_PSRAM_FUNC_WRAPPER(compact)();
+
+        /// @brief Remove every key.
+        void clear();
+
+        /// @brief Number of keys in the store.
+        uint32_t get_count(){ return count; };
+
+        /// @brief Bytes left at the end of the log.
+        uint32_t get_free(){ return half_size - head; };
+
+        /// @brief Bytes held by replaced or erased records.
+        uint32_t get_dead(){ return dead; };
+
+    private: // private Variables
+        struct Slot{
+            uint32_t key;
+            uint32_t offset;
+            uint32_t len;
+        };
+
+        static constexpr uint32_t EMPTY = 0xFFFFFFFFu;
+
+        MyQSPI_PSRAM& psram;
+
+        uint32_t base, half_size;
+        uint32_t active_base;
+        uint32_t head;
+        uint32_t count, dead;
+
+        Slot slots[MYQSPI_PSRAM_STORE_SLOTS];
+        uint16_t compact_order[MYQSPI_PSRAM_STORE_SLOTS];
+        alignas(4) uint8_t record_buffer[PSRAM_PAGE_SIZE];
+
+    private: // private Functions
+        static uint32_t hash(uint32_t key);
+        static uint32_t record_size(uint32_t len){ return (8u + len + 3u) & ~3u; };
+
+        int32_t find_slot(uint32_t key);
+        bool reserve(uint32_t size, uint32_t& offset);
+};
+
+#include "MyQSPI_PSRAM_Store.hpp"
+
+#endif // MY_QSPI_PSRAM_STORE_H
@@ -0,0 +1,182 @@
+#ifndef MY_QSPI_PSRAM_STORE_IMPL_H
+#define MY_QSPI_PSRAM_STORE_IMPL_H
+
+#include "MyQSPI_PSRAM_Store.h"
+
+/// @brief Create a store in a region of an already initialized psram.
+/// @param psram Psram holding the log.
+/// @param base First byte of the region, rounded up to a page boundary.
+/// @param size Size of the region. Half of it holds the log, the other half is the compaction target.
+MyQSPI_PSRAM_Store::MyQSPI_PSRAM_Store(MyQSPI_PSRAM& psram, uint32_t base, uint32_t size)
+:
+psram(psram)
+{
+    // Records are placed by their offset from base, an unaligned base would make them straddle pages.
+    uint32_t aligned_base = (base + PSRAM_PAGE_SIZE - 1u) & ~(PSRAM_PAGE_SIZE - 1u);
+    size = size > aligned_base - base ? size - (aligned_base - base) : 0u;
+
+    this->base = aligned_base;
+    half_size = (size / 2u) & ~(PSRAM_PAGE_SIZE - 1u);
+    clear();
+}
+
+/// @brief Insert or replace a value. Header and value go out together, in a single burst for values up to 116 bytes.
+/// @param key Key.
+/// @param data Value.
+/// @param len Length of the value, MAX_VALUE_LEN at most.
+/// @return false if the value is too long, the index is full or the log is full even after compaction.
+bool MyQSPI_PSRAM_Store::put(uint32_t key, const uint8_t* data, uint32_t len){
+    if(len > MAX_VALUE_LEN) return false;
+
+    int32_t slot = find_slot(key);
+    if(slot < 0 && count >= MYQSPI_PSRAM_STORE_SLOTS * 3u / 4u) return false;
+
+    uint32_t size = record_size(len);
+    uint32_t offset;
+    if(!reserve(size, offset)) return false;
+
+    // Header and value are staged together so the record goes out in one write.
+    memcpy(record_buffer, &key, 4);
+    memcpy(record_buffer+4, &len, 4);
+    memcpy(record_buffer+8, data, len);
+    psram.write(active_base + offset, record_buffer, size);
+
+    if(slot >= 0){
+        dead += record_size(slots[slot].len);
+        slots[slot].offset = offset;
+        slots[slot].len = len;
+        return true;
+    }
+
+    uint32_t i = hash(key) & (MYQSPI_PSRAM_STORE_SLOTS - 1u);
+    while(slots[i].offset != EMPTY) i = (i + 1u) & (MYQSPI_PSRAM_STORE_SLOTS - 1u);
+
+    slots[i] = {key, offset, len};
+    ++count;
+    return true;
+}
+
+/// @brief Read a value, in a single burst for values up to 128 bytes.
+/// @param key Key.
+/// @param data Read buffer.
+/// @param max_len Size of the read buffer, longer values are truncated.
+/// @return Length of the stored value, -1 if the key is not present.
+int32_t MyQSPI_PSRAM_Store::get(uint32_t key, uint8_t* data, uint32_t max_len){
+    int32_t slot = find_slot(key);
+    if(slot < 0) return -1;
+
+    uint32_t len = slots[slot].len;
+    uint32_t read_len = len < max_len ? len : max_len;
+    if(read_len) psram.read(active_base + slots[slot].offset + 8u, data, read_len);
+
+    return len;
+}
+
+/// @brief Remove a key, the space is reclaimed by the next compaction.
+/// @return false if the key was not present.
+bool MyQSPI_PSRAM_Store::erase(uint32_t key){
+    int32_t slot = find_slot(key);
+    if(slot < 0) return false;
+
+    dead += record_size(slots[slot].len);
+    --count;
+
+    // Backward shift deletion, keeps the probe chains intact without tombstones.
+    uint32_t i = slot;
+    uint32_t j = slot;
+    for(;;){
+        j = (j + 1u) & (MYQSPI_PSRAM_STORE_SLOTS - 1u);
+        if(slots[j].offset == EMPTY) break;
+
+        uint32_t home = hash(slots[j].key) & (MYQSPI_PSRAM_STORE_SLOTS - 1u);
+        bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if(movable){
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i].offset = EMPTY;
+
+    return true;
+}
+
+/// @brief Copy the live records into the other half of the region with pmemcpy and switch to it.
+void MyQSPI_PSRAM_Store::compact(){
+    uint32_t target_base = (active_base == base) ? base + half_size : base;
+    uint32_t target_head = 0;
+
+    // Copy in log order, that way no record lands later than it was, so the live records always fit.
+    uint32_t live = 0;
+    for(uint32_t i = 0; i < MYQSPI_PSRAM_STORE_SLOTS; ++i){
+        if(slots[i].offset != EMPTY) compact_order[live++] = i;
+    }
+    std::sort(compact_order, compact_order + live, [this](uint16_t a, uint16_t b){
+        return slots[a].offset < slots[b].offset;
+    });
+
+    for(uint32_t n = 0; n < live; ++n){
+        Slot& slot = slots[compact_order[n]];
+
+        uint32_t size = record_size(slot.len);
+        if(target_head % PSRAM_PAGE_SIZE + size > PSRAM_PAGE_SIZE){
+            target_head = (target_head + PSRAM_PAGE_SIZE - 1u) & ~(PSRAM_PAGE_SIZE - 1u);
+        }
+
+        psram.pmemcpy(target_base + target_head, active_base + slot.offset, size);
+        slot.offset = target_head;
+        target_head += size;
+    }
+
+    active_base = target_base;
+    head = target_head;
+    dead = 0;
+}
+
+/// @brief Remove every key.
+void MyQSPI_PSRAM_Store::clear(){
+    for(uint32_t i = 0; i < MYQSPI_PSRAM_STORE_SLOTS; ++i) slots[i].offset = EMPTY;
+
+    active_base = base;
+    head = 0;
+    count = 0;
+    dead = 0;
+}
+
+uint32_t MyQSPI_PSRAM_Store::hash(uint32_t key){
+    key ^= key >> 16;
+    key *= 0x85EBCA6Bu;
+    key ^= key >> 13;
+    key *= 0xC2B2AE35u;
+    key ^= key >> 16;
+    return key;
+}
+
+int32_t MyQSPI_PSRAM_Store::find_slot(uint32_t key){
+    uint32_t i = hash(key) & (MYQSPI_PSRAM_STORE_SLOTS - 1u);
+    while(slots[i].offset != EMPTY){
+        if(slots[i].key == key) return i;
+        i = (i + 1u) & (MYQSPI_PSRAM_STORE_SLOTS - 1u);
+    }
+    return -1;
+}
+
+bool MyQSPI_PSRAM_Store::reserve(uint32_t size, uint32_t& offset){
+    for(int attempt = 0; attempt < 2; ++attempt){
+        uint32_t start = head;
+        if(start % PSRAM_PAGE_SIZE + size > PSRAM_PAGE_SIZE){
+            start = (start + PSRAM_PAGE_SIZE - 1u) & ~(PSRAM_PAGE_SIZE - 1u);
+        }
+
+        if(start + size <= half_size){
+            offset = start;
+            head = start + size;
+            return true;
+        }
+
+        if(!dead) return false;
+        compact();
+    }
+    return false;
+}
+
+#endif // MY_QSPI_PSRAM_STORE_IMPL_H
@@ -0,0 +1,58 @@
+#ifndef MY_QSPI_PSRAM_TRACE_H
+#define MY_QSPI_PSRAM_TRACE_H
+
+// Trace format shared by the recorder in MyQSPI_PSRAM and the host replay tool, keep it free of pico includes.
+
+#include <cstdint>
+
+#define MYQSPI_TRACE_MAGIC 0x5254514Du // "MQTR"
+#define MYQSPI_TRACE_VERSION 1u
+
+enum class MyQSPI_TRACE_OP : uint8_t {
+    WRITE8 = 0,
+    WRITE16 = 1,
+    WRITE32 = 2,
+    WRITE64 = 3,
+    WRITE512 = 4,
+    WRITE = 5,
+    READ8 = 6,
+    READ16 = 7,
+    READ32 = 8,
+    READ64 = 9,
+    READ512 = 10,
+    READ = 11,
+    PMEMSET = 12,
+    PMEMCPY = 13,
+    PMEMCPY_SRC = 14, // Follows every PMEMCPY record with the source address.
+    FLUSH = 15,
+    COUNT = 16
+};
+
+/// @brief One recorded call, 12 bytes.
+struct MyQSPI_TraceRecord{
+    uint32_t time_us;
+    uint32_t op_addr; // op in the top 8 bits, psram address in the low 24.
+    uint32_t len;     // Bytes.
+};
+
+/// @brief Header written in front of the records by trace_dump().
+struct MyQSPI_TraceHeader{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_count;
+    uint32_t dropped;
+};
+
+static inline uint32_t myqspi_trace_pack(MyQSPI_TRACE_OP op, uint32_t addr){
+    return (static_cast<uint32_t>(op) << 24) | (addr & 0xFFFFFFu);
+}
+
+static inline MyQSPI_TRACE_OP myqspi_trace_op(const MyQSPI_TraceRecord& record){
+    return static_cast<MyQSPI_TRACE_OP>(record.op_addr >> 24);
+}
+
+static inline uint32_t myqspi_trace_addr(const MyQSPI_TraceRecord& record){
+    return record.op_addr & 0xFFFFFFu;
+}
+
+#endif // MY_QSPI_PSRAM_TRACE_H
@@ -0,0 +1,281 @@
+// Replays a trace recorded with MYQSPI_PSRAM_USE_TRACE against a model of the qspi bus.
+//
+// Build on the host:
+//     cmake -S tools/trace_replay -B build_replay && cmake --build build_replay
+// Run:
+//     ./build_replay/trace_replay trace.bin [options]
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "MyQSPI_PSRAM_Trace.h"
+
+#ifndef PSRAM_PAGE_SIZE
+    #define PSRAM_PAGE_SIZE 1024u
+#endif
+
+struct BusModel{
+    double clock_hz = 148500000.0;  // psram clock, one nibble per clock.
+    uint32_t burst_gap = 9;         // Clocks with CS deasserted between bursts.
+    uint32_t header = 8;            // Command and address nibbles.
+    uint32_t read_wait = 7;         // Wait clocks before read data.
+    double call_ns = 150.0;         // CPU and DMA setup per call.
+    uint32_t write_chunk = 124;     // Payload bytes per write burst.
+    uint32_t read_chunk = 128;      // Payload bytes per read burst.
+    uint32_t fill_chunk = 64;       // Payload bytes per pmemset burst, aligned.
+    bool page_split = true;         // Split bursts at page boundaries, like write(), read() and pmemcpy().
+    bool combine = false;           // Model write combining of small writes.
+};
+
+struct OpStats{
+    uint64_t calls = 0;
+    uint64_t bytes = 0;
+    uint64_t bursts = 0;
+    double ns = 0.0;
+};
+
+static const char* op_names[] = {
+    "write8", "write16", "write32", "write64", "write512", "write",
+    "read8", "read16", "read32", "read64", "read512", "read",
+    "pmemset", "pmemcpy", "pmemcpy_src", "flush"
+};
+
+static double burst_ns(const BusModel& bus, bool read, uint32_t len){
+    uint32_t clocks = bus.burst_gap + bus.header + len * 2u;
+    if(read) clocks += bus.read_wait;
+    return clocks * 1e9 / bus.clock_hz;
+}
+
+// Splits [addr, addr+len) into bursts of at most chunk bytes, optionally aligned to chunk
+// and optionally cut at page boundaries, and returns the modeled bus time.
+static double transfer_ns(const BusModel& bus, bool read, uint32_t addr, uint32_t len, uint32_t chunk, bool aligned, uint64_t& bursts){
+    double ns = 0.0;
+    while(len){
+        uint32_t burst = chunk;
+        if(aligned) burst = chunk - addr % chunk;
+        if(bus.page_split && burst > PSRAM_PAGE_SIZE - addr % PSRAM_PAGE_SIZE) burst = PSRAM_PAGE_SIZE - addr % PSRAM_PAGE_SIZE;
+        if(burst > len) burst = len;
+
+        ns += burst_ns(bus, read, burst);
+        ++bursts;
+
+        addr += burst;
+        len -= burst;
+    }
+    return ns;
+}
+
+static bool is_small_write(MyQSPI_TRACE_OP op){
+    return op == MyQSPI_TRACE_OP::WRITE8 || op == MyQSPI_TRACE_OP::WRITE16
+        || op == MyQSPI_TRACE_OP::WRITE32 || op == MyQSPI_TRACE_OP::WRITE64;
+}
+
+static void replay(const std::vector<MyQSPI_TraceRecord>& records, const BusModel& bus, OpStats* stats){
+    uint32_t run_addr = 0, run_len = 0;
+    OpStats* run_stats = nullptr;
+
+    auto close_run = [&](){
+        if(run_len) run_stats->ns += transfer_ns(bus, false, run_addr, run_len, bus.write_chunk, false, run_stats->bursts);
+        run_len = 0;
+    };
+
+    for(size_t i = 0; i < records.size(); ++i){
+        const MyQSPI_TraceRecord& record = records[i];
+        MyQSPI_TRACE_OP op = myqspi_trace_op(record);
+        if(op >= MyQSPI_TRACE_OP::COUNT) continue;
+
+        uint32_t addr = myqspi_trace_addr(record);
+        OpStats& op_stats = stats[static_cast<uint32_t>(op)];
+
+        if(op == MyQSPI_TRACE_OP::PMEMCPY_SRC) continue;
+
+        op_stats.calls++;
+        op_stats.bytes += record.len;
+        op_stats.ns += bus.call_ns;
+
+        if(bus.combine && is_small_write(op)){
+            uint32_t run_end = run_addr + run_len;
+            uint32_t new_end = addr + record.len > run_end ? addr + record.len : run_end;
+            if(run_len && addr >= run_addr && addr <= run_end
+            && new_end - run_addr <= bus.write_chunk
+            && (new_end - 1u) / PSRAM_PAGE_SIZE == run_addr / PSRAM_PAGE_SIZE){
+                run_len = new_end - run_addr;
+                continue;
+            }
+            close_run();
+            run_addr = addr;
+            run_len = record.len;
+            run_stats = &op_stats;
+            continue;
+        }
+
+        // Anything else may touch the pending run, write it out first like the driver does.
+        close_run();
+
+        switch(op){
+            case MyQSPI_TRACE_OP::WRITE8:
+            case MyQSPI_TRACE_OP::WRITE16:
+            case MyQSPI_TRACE_OP::WRITE32:
+            case MyQSPI_TRACE_OP::WRITE64:
+            case MyQSPI_TRACE_OP::WRITE512:
+            case MyQSPI_TRACE_OP::WRITE:
+                op_stats.ns += transfer_ns(bus, false, addr, record.len, bus.write_chunk, false, op_stats.bursts);
+                break;
+            case MyQSPI_TRACE_OP::READ8:
+            case MyQSPI_TRACE_OP::READ16:
+            case MyQSPI_TRACE_OP::READ32:
+            case MyQSPI_TRACE_OP::READ64:
+            case MyQSPI_TRACE_OP::READ512:
+            case MyQSPI_TRACE_OP::READ:
+                op_stats.ns += transfer_ns(bus, true, addr, record.len, bus.read_chunk, false, op_stats.bursts);
+                break;
+            case MyQSPI_TRACE_OP::PMEMSET:
+                op_stats.ns += transfer_ns(bus, false, addr, record.len, bus.fill_chunk, true, op_stats.bursts);
+                break;
+            case MyQSPI_TRACE_OP::PMEMCPY:{
+                uint32_t src = addr;
+                if(i + 1 < records.size() && myqspi_trace_op(records[i+1]) == MyQSPI_TRACE_OP::PMEMCPY_SRC){
+                    src = myqspi_trace_addr(records[i+1]);
+                }
+                op_stats.ns += transfer_ns(bus, true, src, record.len, bus.write_chunk, false, op_stats.bursts);
+                op_stats.ns += transfer_ns(bus, false, addr, record.len, bus.write_chunk, false, op_stats.bursts);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    close_run();
+}
+
+static double total_ns(const OpStats* stats){
+    double ns = 0.0;
+    for(uint32_t i = 0; i < static_cast<uint32_t>(MyQSPI_TRACE_OP::COUNT); ++i) ns += stats[i].ns;
+    return ns;
+}
+
+static void print_report(const OpStats* stats){
+    double total = total_ns(stats);
+
+    printf("%-12s %10s %12s %10s %14s %8s\n", "op", "calls", "bytes", "bursts", "time [us]", "share");
+    for(uint32_t i = 0; i < static_cast<uint32_t>(MyQSPI_TRACE_OP::COUNT); ++i){
+        const OpStats& op_stats = stats[i];
+        if(!op_stats.calls) continue;
+        printf("%-12s %10llu %12llu %10llu %14.1f %7.1f%%\n", op_names[i],
+            static_cast<unsigned long long>(op_stats.calls),
+            static_cast<unsigned long long>(op_stats.bytes),
+            static_cast<unsigned long long>(op_stats.bursts),
+            op_stats.ns / 1000.0,
+            total > 0.0 ? 100.0 * op_stats.ns / total : 0.0);
+    }
+    printf("%-12s %60.1f\n", "total", total / 1000.0);
+}
+
+static void print_sweep(const std::vector<MyQSPI_TraceRecord>& records, const BusModel& base){
+    static const uint32_t write_chunks[] = {32, 64, 124};
+    static const uint32_t read_chunks[] = {32, 64, 128};
+
+    printf("\n%-12s %-12s %-10s %14s\n", "write_chunk", "read_chunk", "combine", "time [us]");
+    for(uint32_t write_chunk : write_chunks){
+        for(uint32_t read_chunk : read_chunks){
+            for(int combine = 0; combine < 2; ++combine){
+                BusModel bus = base;
+                bus.write_chunk = write_chunk;
+                bus.read_chunk = read_chunk;
+                bus.combine = combine;
+
+                OpStats stats[static_cast<uint32_t>(MyQSPI_TRACE_OP::COUNT)];
+                replay(records, bus, stats);
+                printf("%-12u %-12u %-10s %14.1f\n", write_chunk, read_chunk,
+                    combine ? "on" : "off", total_ns(stats) / 1000.0);
+            }
+        }
+    }
+}
+
+static void usage(const char* name){
+    fprintf(stderr,
+        "usage: %s trace.bin [options]\n"
+        "  --clock HZ          psram clock (default 148500000)\n"
+        "  --call-ns NS        cpu/dma setup per call (default 150)\n"
+        "  --burst-gap N       clocks between bursts (default 9)\n"
+        "  --write-chunk N     payload bytes per write burst, max 124 (default 124)\n"
+        "  --read-chunk N      payload bytes per read burst, max 128 (default 128)\n"
+        "  --fill-chunk N      payload bytes per pmemset burst (default 64)\n"
+        "  --no-page-split     don't split bursts at %u byte pages\n"
+        "  --combine           model write combining of small writes\n"
+        "  --sweep             compare chunk sizes and combining\n",
+        name, PSRAM_PAGE_SIZE);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        usage(argv[0]);
+        return 1;
+    }
+
+    BusModel bus;
+    bool sweep = false;
+
+    for(int i = 2; i < argc; ++i){
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if(arg == "--clock" && has_value) bus.clock_hz = atof(argv[++i]);
+        else if(arg == "--call-ns" && has_value) bus.call_ns = atof(argv[++i]);
+        else if(arg == "--burst-gap" && has_value) bus.burst_gap = atoi(argv[++i]);
+        else if(arg == "--write-chunk" && has_value) bus.write_chunk = atoi(argv[++i]);
+        else if(arg == "--read-chunk" && has_value) bus.read_chunk = atoi(argv[++i]);
+        else if(arg == "--fill-chunk" && has_value) bus.fill_chunk = atoi(argv[++i]);
+        else if(arg == "--no-page-split") bus.page_split = false;
+        else if(arg == "--combine") bus.combine = true;
+        else if(arg == "--sweep") sweep = true;
+        else{
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(!bus.write_chunk || bus.write_chunk > 124u || !bus.read_chunk || bus.read_chunk > 128u || !bus.fill_chunk || bus.fill_chunk > 124u){
+        fprintf(stderr, "chunk sizes must be 1..124 for writes and fills, 1..128 for reads\n");
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if(!file){
+        perror(argv[1]);
+        return 1;
+    }
+
+    MyQSPI_TraceHeader header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != MYQSPI_TRACE_MAGIC || header.version != MYQSPI_TRACE_VERSION){
+        fprintf(stderr, "%s: not a MyQSPI_PSRAM trace\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    std::vector<MyQSPI_TraceRecord> records(header.record_count);
+    size_t read_count = fread(records.data(), sizeof(MyQSPI_TraceRecord), records.size(), file);
+    fclose(file);
+    records.resize(read_count);
+
+    if(read_count != header.record_count){
+        fprintf(stderr, "warning: trace truncated, %zu of %u records\n", read_count, header.record_count);
+    }
+
+    printf("records: %zu, dropped: %u", records.size(), header.dropped);
+    if(!records.empty()) printf(", recorded span: %u us", records.back().time_us - records.front().time_us);
+    printf("\n\n");
+
+    OpStats stats[static_cast<uint32_t>(MyQSPI_TRACE_OP::COUNT)];
+    replay(records, bus, stats);
+    print_report(stats);
+
+    if(sweep) print_sweep(records, bus);
+
+    return 0;
+}